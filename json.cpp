@@ -29,12 +29,27 @@
 
 #include "json.hpp"
 
+#include <charconv>
 #include <cstdio>
 #include <cstring>
 #include <cctype>
 #include <cstdlib>
 #include <cmath>
 #include <limits>
+#include <new>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 namespace {
     struct json_value;
@@ -60,6 +75,11 @@ namespace {
                 char *ptr; // null terminated
             } string;
 
+            struct {
+                unsigned int length;
+                const char *ptr;
+            } number;
+
             struct {
                 unsigned int length;
                 object_entry *values;
@@ -74,11 +94,12 @@ namespace {
         union {
             void *object_mem;
             json_value *next_alloc;
+            std::size_t capacity;  // of array or object table in json::document, if larger than length
         } _reserved;
 
-#ifdef JSON_TRACK_SOURCE
-        // Location of the value in the source JSON
-        unsigned int line, col;
+#ifdef JSON_TRACK_SPAN
+        // Position and length of the text of the value in the source JSON
+        std::size_t offset, length;
 #endif
     };
     static_assert(std::is_standard_layout_v<json_value>);
@@ -101,17 +122,198 @@ namespace {
         }
     }
 
+    // Structural hash is a sum over all leaves (scalars and empty containers) of the hash of
+    // the leaf mixed with the hash of its path, so that object members can come in any order.
+    // Each step of the path extends it as `path * hash_step + token`, which can be reverted
+    // when leaving the value, hence only paths of the first few levels need to be kept.
+    constexpr uint64_t hash_step = 0x9E3779B97F4A7C15ull;
+
+    constexpr uint64_t inverse(uint64_t m) noexcept {
+        uint64_t x = m;
+        for (int i = 0; i < 6; ++i)
+            x *= 2 - m * x;
+
+        return x;
+    }
+
+    constexpr uint64_t hash_step_inverse = inverse(hash_step);
+    static_assert(hash_step * hash_step_inverse == 1);
+
+    constexpr uint64_t hash_mix(uint64_t h) noexcept {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        return h ^ (h >> 33);
+    }
+
+    uint64_t hash_bytes(const char *str, std::size_t length, uint64_t seed) noexcept {
+        uint64_t h = seed ^ (length * hash_step);
+        uint64_t word;
+
+        for (; length >= 8; str += 8, length -= 8) {
+            std::memcpy(&word, str, 8);
+            h = (h ^ word) * 0xBF58476D1CE4E5B9ull;
+            h ^= h >> 31;
+        }
+
+        word = 0;
+        std::memcpy(&word, str, length);
+        return hash_mix(h ^ word);
+    }
+
+    // Converts a number known to be valid: as an integer if it has neither fraction nor exponent
+    // and fits int64_t, otherwise as a double (infinite or zero if out of range)
+    json::type convert_number(const char *ptr, const char *end, int64_t &integer, double &dbl) noexcept {
+        const char *exponent = ptr;
+        while (exponent < end && *exponent != 'e' && *exponent != 'E')
+            ++exponent;
+
+        if (exponent == end && !std::memchr(ptr, '.', end - ptr)
+            && std::from_chars(ptr, end, integer).ec == std::errc()) {
+            return json::json_integer;
+        }
+
+        if (std::from_chars(ptr, end, dbl).ec == std::errc::result_out_of_range) {
+            const double magnitude = exponent + 1 < end && exponent[1] == '-'
+                                     ? 0.0 : std::numeric_limits<double>::infinity();
+            dbl = *ptr == '-' ? -magnitude : magnitude;
+        }
+
+        return json::json_double;
+    }
+
+    // Value of json_number converted into `converted` as json_integer or json_double, so that
+    // it compares and hashes like them; other values are returned as they are
+    const json::value *converted_number(const json::value *value, json::value &converted) noexcept {
+        if (value->type != json::json_number)
+            return value;
+
+        int64_t integer = 0;
+        double dbl = 0;
+
+        converted.type = convert_number(value->u.number.ptr, value->u.number.ptr + value->u.number.length,
+                                        integer, dbl);
+        if (converted.type == json::json_integer)
+            converted.u.integer = integer;
+        else
+            converted.u.dbl = dbl;
+
+        return &converted;
+    }
+
+    // Numbers equal to an integer hash as that integer, see json::equal
+    bool integral(double dbl, int64_t *integer) noexcept {
+        if (!(dbl >= -9223372036854775808.0 && dbl < 9223372036854775808.0))
+            return false;
+
+        *integer = (int64_t) dbl;
+        return (double) *integer == dbl;
+    }
+
+    uint64_t hash_leaf(const json::value *value) noexcept {
+        json::value converted;
+        int64_t integer;
+        uint64_t bits;
+
+        value = converted_number(value, converted);
+
+        switch (value->type) {
+            case json::json_integer:
+                return hash_mix(value->u.integer ^ 0x3C6EF372FE94F82Bull);
+
+            case json::json_double:
+                if (integral(value->u.dbl, &integer))
+                    return hash_mix(integer ^ 0x3C6EF372FE94F82Bull);
+
+                std::memcpy(&bits, &value->u.dbl, sizeof(bits));
+                return hash_mix(bits ^ 0xA54FF53A5F1D36F1ull);
+
+            case json::json_string:
+                return hash_bytes(value->u.string.ptr, value->u.string.length, 0x510E527FADE682D1ull);
+
+            case json::json_boolean:
+                return hash_mix(value->u.boolean ? 0x9B05688C2B3E6C1Full : 0x1F83D9ABFB41BD6Bull);
+
+            default:
+                return hash_mix(value->type);
+        }
+    }
+
+    struct structural_hash {
+        constexpr static unsigned int saved_max = 64;
+        uint64_t saved[saved_max];  // paths of the innermost containers, saves reverting them
+        uint64_t path, sum;
+        unsigned int depth;
+        bool ordered;
+
+        void reset(bool order) noexcept {
+            path = 0x5BE0CD19137E2179ull;
+            sum = 0;
+            depth = 0;
+            ordered = order;
+        }
+
+        uint64_t token(const json::value *parent, unsigned int index) const noexcept {
+            if (parent->type != json::json_object)
+                return hash_mix(index ^ 0x6A09E667F3BCC908ull);
+
+            const json::object_entry &entry = parent->u.object.values[index];
+            const uint64_t h = hash_bytes(entry.name, entry.name_length, 0xBB67AE8584CAA73Bull);
+            return ordered ? h + hash_mix(index) : h;
+        }
+
+        void enter(const json::value *parent, unsigned int index) noexcept {
+            if (depth < saved_max)
+                saved[depth] = path;
+
+            ++depth;
+            path = path * hash_step + token(parent, index);
+        }
+
+        void leave(const json::value *parent, unsigned int index) noexcept {
+            if (--depth < saved_max)
+                path = saved[depth];
+            else
+                path = (path - token(parent, index)) * hash_step_inverse;
+        }
+
+        // Called for every value, adds it if it is a leaf
+        void add(const json::value *value) noexcept {
+            if ((value->type != json::json_object && value->type != json::json_array) || !value->u.array.length)
+                sum += hash_mix(path ^ hash_leaf(value));
+        }
+
+        uint64_t result() const noexcept {
+            return hash_mix(sum);
+        }
+    };
+
+    struct scan_stack;
+
     struct json_state {
         unsigned long used_memory;
 
         unsigned int uint_max;
         unsigned long ulong_max;
+        unsigned int string_max;
 
         json::settings settings;
         int first_pass;
 
         const char *ptr;
-        unsigned int cur_line, cur_col;
+        const char *value_start;  // first character of the value being parsed
+
+        // with settings.track_source, lines are counted up to `counted` when a value is found
+        const char *counted, *line_start;
+        unsigned int cur_line;
+
+#ifdef JSON_TRACK_SPAN
+        const char *input;
+#endif
+
+        structural_hash hash;  // only computed in the second pass, if requested
+        scan_stack *scan;  // only with feature_scan
     };
 
     void *default_alloc(size_t size, int zero, void *) noexcept {
@@ -122,11 +324,111 @@ namespace {
         std::free(ptr);
     }
 
+    // Fills in allocation functions not set by the user
+    void default_allocator(json::settings &settings) noexcept {
+        if (!settings.mem_alloc)
+            settings.mem_alloc = default_alloc;
+
+        if (!settings.mem_free)
+            settings.mem_free = default_free;
+    }
+
+    // Moves past UTF-8 BOM, if the input starts with one
+    void skip_bom(const char *&json, std::size_t &length) noexcept {
+        if (length >= 3 && ((unsigned char) json[0]) == 0xEF
+            && ((unsigned char) json[1]) == 0xBB
+            && ((unsigned char) json[2]) == 0xBF) {
+            json += 3;
+            length -= 3;
+        }
+    }
+
+    // Options the parser is compiled either without, or with and then testing the settings at
+    // run time, so that common configurations run loops free of tests for options they do not use
+    enum : unsigned int {
+        feature_first_pass = 1 << 0,
+        feature_comments = 1 << 1,
+        feature_json5 = 1 << 2,
+        feature_strict_utf8 = 1 << 3,
+        feature_limits = 1 << 4,  // max_depth, max_values, max_elements, max_number_length, max_memory
+        feature_track_source = 1 << 5,
+        feature_hash = 1 << 6,
+        feature_exact_numbers = 1 << 7,
+        feature_scan = 1 << 8,  // only checks syntax in a first pass, see scan_stack
+    };
+
+    // Sets of features the parser is compiled for (besides the first pass)
+    constexpr unsigned int features_none = 0;
+    constexpr unsigned int features_comments = feature_comments;
+    constexpr unsigned int features_json5 = feature_comments | feature_json5;
+    constexpr unsigned int features_untrusted = feature_strict_utf8 | feature_limits;
+    constexpr unsigned int features_exact = feature_exact_numbers;
+    constexpr unsigned int features_all = feature_comments | feature_json5 | feature_strict_utf8
+                                          | feature_limits | feature_track_source | feature_hash
+                                          | feature_exact_numbers;
+
+    // The smallest of these sets covering all options enabled in `settings`
+    unsigned int select_features(const json::settings &settings) noexcept {
+        unsigned int used = 0;
+
+        if (settings.allow_comments)
+            used |= feature_comments;
+
+        if (settings.json5)
+            used |= feature_comments | feature_json5;
+
+        if (settings.strict_utf8)
+            used |= feature_strict_utf8;
+
+        if (settings.max_depth || settings.max_values || settings.max_elements
+            || settings.max_number_length || settings.max_memory) {
+            used |= feature_limits;
+        }
+
+        if (settings.track_source)
+            used |= feature_track_source;
+
+        if (settings.hash)
+            used |= feature_hash;
+
+        if (settings.exact_numbers)
+            used |= feature_exact_numbers;
+
+        for (const unsigned int features : { features_none, features_comments, features_json5, features_untrusted,
+                                             features_exact }) {
+            if (!(used & ~features))
+                return features;
+        }
+
+        return features_all;
+    }
+
+    // Nesting limit of json::validate, which keeps its stack of open containers in fixed size bitmap
+    constexpr static unsigned int validate_max_depth = 1 << 16;
+    // ... and lower limit when it also has to count elements of each open container
+    constexpr static unsigned int validate_max_counted_depth = 1 << 12;
+
+    // What a pass with feature_scan keeps instead of allocating values: `value` stands for
+    // each value in turn, and takes the type of the innermost open container when one ends
+    struct scan_stack {
+        json_value value;
+        uint64_t containers[validate_max_depth / 64];  // bitmap of open containers, 1 for object
+        unsigned int elements[validate_max_counted_depth];  // element counts, only if limited
+        unsigned int depth, max_depth;
+        bool stop;  // after the first complete value, ending at `value_end`
+        const char *value_end;
+
+        json::type container(unsigned int level) const noexcept {
+            return ((containers[level / 64] >> (level % 64)) & 1) ? json::json_object : json::json_array;
+        }
+    };
+
+    template<unsigned int features>
     void *json_alloc(json_state *state, unsigned long size, bool zero) noexcept {
         if ((state->ulong_max - state->used_memory) < size)
             return nullptr;
 
-        if (state->settings.max_memory
+        if ((features & feature_limits) && state->settings.max_memory
             && (state->used_memory += size) > state->settings.max_memory) {
             return nullptr;
         }
@@ -134,16 +436,50 @@ namespace {
         return state->settings.mem_alloc(size, zero, state->settings.user_data);
     }
 
+    template<unsigned int features>
     bool new_value(json_state *state,
                    json_value **top, json_value **root, json_value **alloc,
                    json::type type) noexcept
     {
+        constexpr bool first_pass = features & feature_first_pass;
+        constexpr bool scan = features & feature_scan;
+        const bool track_source = (features & feature_track_source) && state->settings.track_source;
         json_value *value;
         int values_size;
 
-        if (!state->first_pass) {
+        if (scan) {
+            scan_stack &stack = *state->scan;
+
+            if (type == json::json_object || type == json::json_array) {
+                if (stack.depth == stack.max_depth)
+                    return false;
+
+                if ((features & feature_limits) && state->settings.max_elements)
+                    stack.elements[stack.depth] = 0;
+
+                const uint64_t bit = uint64_t(1) << (stack.depth % 64);
+                if (type == json::json_object)
+                    stack.containers[stack.depth / 64] |= bit;
+                else
+                    stack.containers[stack.depth / 64] &= ~bit;
+
+                ++stack.depth;
+            }
+
+            stack.value.type = type;
+            *top = *root = &stack.value;
+            return true;
+        }
+
+        if (!first_pass) {
             value = *top = *alloc;
             *alloc = (*alloc)->_reserved.next_alloc;
+            value->_reserved.next_alloc = nullptr;
+
+            if ((features & feature_hash) && state->settings.hash && value->parent) {
+                state->hash.enter(reinterpret_cast<json::value *>(value->parent),
+                                  value->parent->u.array.length);
+            }
 
             if (!*root)
                 *root = value;
@@ -153,8 +489,9 @@ namespace {
                     if (value->u.array.length == 0)
                         break;
 
-                    if (!(value->u.array.values = (json_value **) json_alloc
+                    if (!(value->u.array.values = (json_value **) json_alloc<features>
                             (state, value->u.array.length * sizeof(json_value *), false))) {
+                        value->u.array.length = 0;  // so that it can be freed
                         return false;
                     }
 
@@ -167,8 +504,9 @@ namespace {
 
                     values_size = sizeof(*value->u.object.values) * value->u.object.length;
 
-                    if (!(value->u.object.values = (object_entry *) json_alloc
+                    if (!(value->u.object.values = (object_entry *) json_alloc<features>
                             (state, values_size + ((unsigned long) value->u.object.values), false))) {
+                        value->u.object.length = 0;
                         return false;
                     }
 
@@ -178,7 +516,7 @@ namespace {
                     break;
 
                 case json::json_string:
-                    if (!(value->u.string.ptr = (char *) json_alloc
+                    if (!(value->u.string.ptr = (char *) json_alloc<features>
                             (state, (value->u.string.length + 1) * sizeof(char), false))) {
                         return false;
                     }
@@ -193,8 +531,9 @@ namespace {
             return true;
         }
 
-        if (!(value = (json_value *) json_alloc
-                (state, sizeof(value) + state->settings.value_extra, true))) {
+        if (!(value = (json_value *) json_alloc<features>
+                (state, sizeof(*value) + (track_source ? sizeof(json::source_location) : 0)
+                        + state->settings.value_extra, true))) {
             return false;
         }
 
@@ -204,9 +543,23 @@ namespace {
         value->type = type;
         value->parent = *top;
 
-#ifdef JSON_TRACK_SOURCE
-        value->line = state->cur_line;
-        value->col = state->cur_col;
+        if (track_source) {
+            // count lines since the previous value
+            const char *newline = state->counted;
+            while ((newline = (const char *) std::memchr(newline, '\n', state->value_start - newline))) {
+                ++state->cur_line;
+                state->line_start = ++newline;
+            }
+
+            state->counted = state->value_start;
+
+            json::source_location *location = reinterpret_cast<json::source_location *>(value + 1);
+            location->line = state->cur_line;
+            location->col = state->value_start - state->line_start + 1;
+        }
+
+#ifdef JSON_TRACK_SPAN
+        value->offset = state->value_start - state->input;
 #endif
         if (*alloc)
             (*alloc)->_reserved.next_alloc = value;
@@ -224,723 +577,4241 @@ namespace {
             flag_string = 1 << 5,
             flag_need_colon = 1 << 6,
             flag_done = 1 << 7,
-            flag_num_negative = 1 << 8,
-            flag_num_zero = 1 << 9,
-            flag_num_e = 1 << 10,
-            flag_num_e_got_sign = 1 << 11,
-            flag_num_e_negative = 1 << 12,
-            flag_line_comment = 1 << 13,
-            flag_block_comment = 1 << 14;
-}
-
-#define WHITESPACE \
-    case '\n': ++ state.cur_line;  state.cur_col = 0; \
-    case ' ': case '\t': case '\r'
+            flag_line_comment = 1 << 8,
+            flag_block_comment = 1 << 9,
+            flag_single_quote = 1 << 10;
+
+    // Returns pointer to the first character in [ptr, end) which cannot be copied
+    // verbatim inside a string, i.e. `"`, `\\` or a control character (including null)
+    const char *skip_string(const char *ptr, const char *end) noexcept {
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+
+        for (; end - ptr >= 16; ptr += 16) {
+            const __m128i chunk = _mm_loadu_si128((const __m128i *) ptr);
+            const __m128i special = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                    _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+
+            const int mask = _mm_movemask_epi8(special);
+            if (mask)
+                return ptr + __builtin_ctz(mask);
+        }
+#endif
+        while (ptr < end && *ptr != '"' && *ptr != '\\' && ((unsigned char) *ptr) >= 0x20)
+            ++ptr;
 
-#define STRING_ADD(b)  \
-    do { if (!state.first_pass) string [string_length] = b;  ++ string_length; } while (0)
+        return ptr;
+    }
 
-#define LINE_AND_COL \
-    state.cur_line, state.cur_col
+    // Checks that [ptr, ptr + length) is well-formed UTF-8 (no overlong forms, surrogates or
+    // code points above U+10FFFF), using lookup tables indexed by nibbles of adjacent bytes
+    // as described by Keiser and Lemire in "Validating UTF-8 In Less Than One Instruction Per Byte"
+    bool valid_utf8(const char *ptr, std::size_t length) noexcept {
+#ifdef __SSSE3__
+        // error bits, each set in exactly one of the three tables for a byte pair matching the pattern
+        constexpr char too_short = 1 << 0;   // 11______ 0_______ or 11______ 11______
+        constexpr char too_long = 1 << 1;    // 0_______ 10______
+        constexpr char overlong_3 = 1 << 2;  // 11100000 100_____
+        constexpr char too_large = 1 << 3;   // 11110100 1001____ and above
+        constexpr char surrogate = 1 << 4;   // 11101101 101_____
+        constexpr char overlong_2 = 1 << 5;  // 1100000_ 10______
+        constexpr char too_large_1000 = 1 << 6;  // 11110101 1000____ and above
+        constexpr char overlong_4 = 1 << 6;  // 11110000 1000____
+        constexpr char two_conts = (char) (1 << 7);  // 10______ 10______
+        constexpr char carry = too_short | too_long | two_conts;
+
+        const __m128i byte_1_high_table = _mm_setr_epi8(
+                too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+                two_conts, two_conts, two_conts, two_conts,
+                too_short | overlong_2,
+                too_short,
+                too_short | overlong_3 | surrogate,
+                too_short | too_large | too_large_1000 | overlong_4);
+
+        const __m128i byte_1_low_table = _mm_setr_epi8(
+                carry | overlong_3 | overlong_2 | overlong_4,
+                carry | overlong_2,
+                carry,
+                carry,
+                carry | too_large,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000 | surrogate,
+                carry | too_large | too_large_1000,
+                carry | too_large | too_large_1000);
+
+        const __m128i byte_2_high_table = _mm_setr_epi8(
+                too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+                too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+                too_long | overlong_2 | two_conts | overlong_3 | too_large,
+                too_long | overlong_2 | two_conts | surrogate | too_large,
+                too_long | overlong_2 | two_conts | surrogate | too_large,
+                too_short, too_short, too_short, too_short);
+
+        // anything above these in the last three bytes of a block starts an unfinished sequence
+        const __m128i incomplete_max = _mm_setr_epi8(
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        __m128i error = _mm_setzero_si128();
+        __m128i incomplete = _mm_setzero_si128();
+        __m128i prev = _mm_setzero_si128();
+
+        while (length) {
+            __m128i input;
+            if (length >= 16) {
+                input = _mm_loadu_si128((const __m128i *) ptr);
+                ptr += 16;
+                length -= 16;
+            } else {
+                // zero padding is ASCII, so any sequence cut short will be reported
+                char tail[16] = {0};
+                std::memcpy(tail, ptr, length);
+                input = _mm_loadu_si128((const __m128i *) tail);
+                length = 0;
+            }
 
-const json::value * json::parse(const json::settings & settings,
-                                const char * json,
-                                size_t length,
-                                char * error_buf) noexcept
-{
-    // Skip UTF-8 BOM
-    if (length >= 3 && ((unsigned char) json[0]) == 0xEF
-        && ((unsigned char) json[1]) == 0xBB
-        && ((unsigned char) json[2]) == 0xBF) {
-        json += 3;
-        length -= 3;
-    }
+            if (!_mm_movemask_epi8(input)) {
+                error = _mm_or_si128(error, incomplete);
+                incomplete = _mm_setzero_si128();
+            } else {
+                const __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+                const __m128i special = _mm_and_si128(
+                        _mm_and_si128(
+                                _mm_shuffle_epi8(byte_1_high_table,
+                                                 _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                                _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble))),
+                        _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+                // third and fourth bytes of a sequence must be continuations, and nothing else may be
+                const __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+                const __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+                const __m128i must_23 = _mm_or_si128(
+                        _mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xE0 - 0x80))),
+                        _mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xF0 - 0x80))));
+                const __m128i must_23_80 = _mm_and_si128(must_23, _mm_set1_epi8((char) 0x80));
+
+                error = _mm_or_si128(error, _mm_xor_si128(must_23_80, special));
+                incomplete = _mm_subs_epu8(input, incomplete_max);
+            }
 
-    char error[json::error_max];
-    error[0] = '\0';
-    const char *const end = (json + length);
+            prev = input;
+        }
 
-    json_state state = {0};
-    state.settings = settings;
+        error = _mm_or_si128(error, incomplete);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+#else
+        const unsigned char *b = (const unsigned char *) ptr;
+        const unsigned char *const end = b + length;
 
-    if (!state.settings.mem_alloc)
-        state.settings.mem_alloc = default_alloc;
+        while (b < end) {
+            if (*b < 0x80) {
+                ++b;
+                continue;
+            }
 
-    if (!state.settings.mem_free)
-        state.settings.mem_free = default_free;
+            int count;
+            uint32_t min;
+            uint32_t uchar;
+            if ((*b & 0xE0) == 0xC0) {
+                count = 1; min = 0x80; uchar = *b & 0x1F;
+            } else if ((*b & 0xF0) == 0xE0) {
+                count = 2; min = 0x800; uchar = *b & 0x0F;
+            } else if ((*b & 0xF8) == 0xF0) {
+                count = 3; min = 0x10000; uchar = *b & 0x07;
+            } else
+                return false;
+
+            if (end - b <= count)
+                return false;
+
+            for (int i = 1; i <= count; ++i) {
+                if ((b[i] & 0xC0) != 0x80)
+                    return false;
+                uchar = (uchar << 6) | (b[i] & 0x3F);
+            }
 
-    // limit of how much can be added before next check
-    state.uint_max = std::numeric_limits<decltype(state.uint_max)>::max() - 8;
-    state.ulong_max = std::numeric_limits<decltype(state.ulong_max)>::max() - 8;
+            if (uchar < min || uchar > 0x10FFFF || (uchar & 0xFFFFF800) == 0xD800)
+                return false;
 
-    json_value *top, *root, *alloc = nullptr;
-    for (state.first_pass = 1; state.first_pass >= 0; --state.first_pass) {
-        top = root = nullptr;
-        long flags = flag_seek_value;
-        state.cur_line = 1;
-        char *string = nullptr;
-        unsigned int string_length = 0;
-        long num_digits = 0, num_e = 0;
-        int64_t num_fraction = 0;
-
-        for (state.ptr = json;; ++state.ptr) {
-            char b = (state.ptr == end ? 0 : *state.ptr);
-
-            if (flags & flag_string) {
-                if (!b) {
-                    std::sprintf(error,
-                                 "Unexpected EOF in string (at %d:%d)",
-                                 LINE_AND_COL);
-                    goto e_failed;
-                }
+            b += count + 1;
+        }
 
-                if (string_length > state.uint_max)
-                    goto e_overflow;
+        return true;
+#endif
+    }
 
-                if (flags & flag_escaped) {
-                    flags &= ~flag_escaped;
-                    unsigned char uc_b1, uc_b2, uc_b3, uc_b4;
-                    uint32_t uchar;
+    // Finds the end of a number at ptr without converting it. Sets `code` and returns where
+    // it is wrong if it is not valid.
+    const char *skip_number(const char *ptr, const char *end, json::error_code &code) noexcept {
+        code = json::error_none;
 
-                    switch (b) {
-                        case 'b': STRING_ADD('\b'); break;
-                        case 'f': STRING_ADD('\f'); break;
-                        case 'n': STRING_ADD('\n'); break;
-                        case 'r': STRING_ADD('\r'); break;
-                        case 't': STRING_ADD('\t'); break;
-                        case 'u':
-                            if (end - state.ptr <= 4 ||
-                                (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
-                                (uc_b2 = hex_value(*++state.ptr)) == 0xFF ||
-                                (uc_b3 = hex_value(*++state.ptr)) == 0xFF ||
-                                (uc_b4 = hex_value(*++state.ptr)) == 0xFF) {
-                                std::sprintf(error,
-                                             "Invalid character value `%c` (at %d:%d)", b,
-                                             LINE_AND_COL);
-                                goto e_failed;
-                            }
+        if (ptr < end && *ptr == '-')
+            ++ptr;
 
-                            uc_b1 = (uc_b1 << 4) | uc_b2;
-                            uc_b2 = (uc_b3 << 4) | uc_b4;
-                            uchar = (uc_b1 << 8) | uc_b2;
-
-                            if ((uchar & 0xF800) == 0xD800) {
-                                if (end - state.ptr <= 6 ||
-                                    (*++state.ptr) != '\\' ||
-                                    (*++state.ptr) != 'u' ||
-                                    (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
-                                    (uc_b2 = hex_value(*++state.ptr)) == 0xFF ||
-                                    (uc_b3 = hex_value(*++state.ptr)) == 0xFF ||
-                                    (uc_b4 = hex_value(*++state.ptr)) == 0xFF) {
-                                    std::sprintf(error,
-                                                 "Invalid character value `%c` (at %d:%d)", b,
-                                                 LINE_AND_COL);
-                                    goto e_failed;
-                                }
+        const char *const digits = ptr;
+        for (; ptr < end && std::isdigit(*ptr); ++ptr) {
+            if (ptr - digits == 1 && *digits == '0') {
+                code = json::error_leading_zero;
+                return ptr;
+            }
+        }
 
-                                uc_b1 = (uc_b1 << 4) | uc_b2;
-                                uc_b2 = (uc_b3 << 4) | uc_b4;
-                                const uint32_t uchar2 = (uc_b1 << 8) | uc_b2;
-                                uchar = 0x010000 | ((uchar & 0x3FF) << 10) | (uchar2 & 0x3FF);
-                            }
+        if (ptr == digits) {
+            code = ptr < end && *ptr == '.' ? json::error_digit_before_point : json::error_digit_after_minus;
+            return ptr;
+        }
 
-                            if (uchar <= 0x7F) {
-                                STRING_ADD((char) uchar);
-                                break;
-                            }
+        if (ptr < end && *ptr == '.') {
+            const char *const fraction = ++ptr;
+            while (ptr < end && std::isdigit(*ptr))
+                ++ptr;
 
-                            if (uchar <= 0x7FF) {
-                                if (state.first_pass)
-                                    string_length += 2;
-                                else {
-                                    string[string_length++] = 0xC0 | (uchar >> 6);
-                                    string[string_length++] = 0x80 | (uchar & 0x3F);
-                                }
+            if (ptr == fraction) {
+                code = json::error_digit_after_point;
+                return ptr;
+            }
+        }
 
-                                break;
-                            }
+        if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+            if (++ptr < end && (*ptr == '+' || *ptr == '-'))
+                ++ptr;
 
-                            if (uchar <= 0xFFFF) {
-                                if (state.first_pass)
-                                    string_length += 3;
-                                else {
-                                    string[string_length++] = 0xE0 | (uchar >> 12);
-                                    string[string_length++] = 0x80 | ((uchar >> 6) & 0x3F);
-                                    string[string_length++] = 0x80 | (uchar & 0x3F);
-                                }
+            const char *const exponent = ptr;
+            while (ptr < end && std::isdigit(*ptr))
+                ++ptr;
 
-                                break;
-                            }
+            if (ptr == exponent)
+                code = json::error_digit_after_exponent;
+        }
 
-                            if (state.first_pass)
-                                string_length += 4;
-                            else {
-                                string[string_length++] = 0xF0 | (uchar >> 18);
-                                string[string_length++] = 0x80 | ((uchar >> 12) & 0x3F);
-                                string[string_length++] = 0x80 | ((uchar >> 6) & 0x3F);
-                                string[string_length++] = 0x80 | (uchar & 0x3F);
-                            }
+        return ptr;
+    }
 
-                            break;
+    // Reads a JSON5 number at ptr: optionally signed decimal (which may start or end with
+    // the point), hexadecimal, Infinity or NaN. Returns its end, or null if it is not valid.
+    // If `value` is set, stores the number in it.
+    const char *json5_number(const char *ptr, const char *end, json_value *value) noexcept {
+        const bool negative = *ptr == '-';
+        if (*ptr == '-' || *ptr == '+')
+            ++ptr;
 
-                        default:
-                            STRING_ADD(b);
-                    }
+        if (ptr == end)
+            return nullptr;
 
-                    continue;
-                }
+        if (*ptr == 'I' || *ptr == 'N') {
+            const bool infinity = *ptr == 'I';
+            const std::size_t length = infinity ? 8 : 3;
 
-                if (b == '\\') {
-                    flags |= flag_escaped;
-                    continue;
-                }
+            if (std::size_t(end - ptr) < length || std::memcmp(ptr, infinity ? "Infinity" : "NaN", length))
+                return nullptr;
 
-                if (b == '"') {
-                    if (!state.first_pass)
-                        string[string_length] = 0;
+            if (value) {
+                value->type = json::json_double;
+                value->u.dbl = infinity ? std::numeric_limits<double>::infinity()
+                                        : std::numeric_limits<double>::quiet_NaN();
+                if (negative)
+                    value->u.dbl = -value->u.dbl;
+            }
 
-                    flags &= ~flag_string;
-                    string = nullptr;
+            return ptr + length;
+        }
 
-                    switch (top->type) {
-                        case json_string:
-                            top->u.string.length = string_length;
-                            flags |= flag_next;
-                            break;
+        if (*ptr == '0' && end - ptr > 1 && (ptr[1] == 'x' || ptr[1] == 'X')) {
+            const char *const digits = ptr += 2;
+            uint64_t magnitude = 0;
+            double dbl = 0;
+            bool overflow = false;
 
-                        case json_object:
-                            if (state.first_pass)
-                                (*(char **) &top->u.object.values) += string_length + 1;
-                            else {
-                                top->u.object.values[top->u.object.length].name
-                                        = (char *) top->_reserved.object_mem;
-                                top->u.object.values[top->u.object.length].name_length
-                                        = string_length;
-                                (*(char **) &top->_reserved.object_mem) += string_length + 1;
-                            }
+            for (unsigned char digit; ptr < end && (digit = hex_value(*ptr)) != 0xFF; ++ptr) {
+                overflow |= magnitude >> 60 != 0;
+                magnitude = (magnitude << 4) | digit;
+                dbl = dbl * 16 + digit;
+            }
 
-                            flags |= flag_seek_value | flag_need_colon;
-                            continue;
+            if (ptr == digits)
+                return nullptr;
 
-                        default:
-                            break;
-                    }
+            if (value) {
+                const uint64_t limit = uint64_t(std::numeric_limits<int64_t>::max()) + negative;
+                if (!overflow && magnitude <= limit) {
+                    value->type = json::json_integer;
+                    value->u.integer = int64_t(negative ? 0 - magnitude : magnitude);
                 } else {
-                    STRING_ADD(b);
-                    continue;
+                    value->type = json::json_double;
+                    value->u.dbl = negative ? -dbl : dbl;
                 }
             }
 
-            if (state.settings.allow_comments) {
-                if (flags & (flag_line_comment | flag_block_comment)) {
-                    if (flags & flag_line_comment) {
-                        if (b == '\r' || b == '\n' || !b) {
-                            flags &= ~flag_line_comment;
-                            --state.ptr;  // so null can be reproc'd
-                        }
+            return ptr;
+        }
 
-                        continue;
-                    }
+        const char *const number = negative ? ptr - 1 : ptr;
+        const char *digits = ptr;
 
-                    if (flags & flag_block_comment) {
-                        if (!b) {
-                            std::sprintf(error,
-                                         "%d:%d: Unexpected EOF in block comment",
-                                         LINE_AND_COL);
-                            goto e_failed;
-                        }
+        while (ptr < end && *ptr >= '0' && *ptr <= '9')
+            ++ptr;
 
-                        if (b == '*' && state.ptr < (end - 1) && state.ptr[1] == '/') {
-                            flags &= ~flag_block_comment;
-                            ++state.ptr;  // skip closing sequence
-                        }
+        if (ptr - digits > 1 && *digits == '0')
+            return nullptr;
 
-                        continue;
-                    }
-                } else if (b == '/') {
-                    if (!(flags & (flag_seek_value | flag_done)) && top->type != json_object) {
-                        std::sprintf(error,
-                                     "%d:%d: Comment not allowed here",
-                                     LINE_AND_COL);
-                        goto e_failed;
-                    }
+        bool any_digits = ptr != digits;
 
-                    if (++state.ptr == end) {
-                        std::sprintf(error,
-                                     "%d:%d: EOF unexpected",
-                                     LINE_AND_COL);
-                        goto e_failed;
-                    }
+        if (ptr < end && *ptr == '.') {
+            digits = ++ptr;
+            while (ptr < end && *ptr >= '0' && *ptr <= '9')
+                ++ptr;
 
-                    switch (b = *state.ptr) {
-                        case '/':
-                            flags |= flag_line_comment;
-                            continue;
+            any_digits |= ptr != digits;
+        }
 
-                        case '*':
-                            flags |= flag_block_comment;
-                            continue;
+        if (!any_digits)
+            return nullptr;
 
-                        default:
-                            std::sprintf(error,
-                                         "%d:%d: Unexpected `%c` in comment opening sequence",
-                                         LINE_AND_COL, b);
-                            goto e_failed;
-                    }
-                }
-            }
+        if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+            if (++ptr < end && (*ptr == '+' || *ptr == '-'))
+                ++ptr;
 
-            if (flags & flag_done) {
-                if (!b)
-                    break;
+            digits = ptr;
+            while (ptr < end && *ptr >= '0' && *ptr <= '9')
+                ++ptr;
 
-                switch (b) {
-                    WHITESPACE:
-                        continue;
+            if (ptr == digits)
+                return nullptr;
+        }
 
-                    default:
-                        std::sprintf(error,
-                                     "%d:%d: Trailing garbage: `%c`",
-                                     LINE_AND_COL, b);
-                        goto e_failed;
-                }
-            }
+        if (value)
+            value->type = convert_number(number, ptr, value->u.integer, value->u.dbl);
 
-            if (flags & flag_seek_value) {
-                switch (b) {
-                    WHITESPACE:
-                        continue;
+        return ptr;
+    }
 
-                    case ']':
-                        if (top && top->type == json_array)
-                            flags = (flags & ~(flag_need_comma | flag_seek_value)) | flag_next;
-                        else {
-                            std::sprintf(error,
-                                         "%d:%d: Unexpected ]",
-                                         LINE_AND_COL);
-                            goto e_failed;
-                        }
+    // JSON5 object keys can be identifiers; bytes of multibyte UTF-8 characters are all taken
+    // as letters, and escape sequences are not supported
+    constexpr bool identifier_start(char c) noexcept {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$'
+               || ((unsigned char) c) >= 0x80;
+    }
 
-                        break;
+    const char *skip_identifier(const char *ptr, const char *end) noexcept {
+        while (ptr < end && (identifier_start(*ptr) || (*ptr >= '0' && *ptr <= '9')))
+            ++ptr;
 
-                    default:
-                        if (flags & flag_need_comma) {
-                            if (b == ',') {
-                                flags &= ~flag_need_comma;
-                                continue;
-                            } else {
-                                std::sprintf(error,
-                                             "%d:%d: Expected , before %c",
-                                             LINE_AND_COL, b);
-                                goto e_failed;
-                            }
-                        }
+        return ptr;
+    }
 
-                        if (flags & flag_need_colon) {
-                            if (b == ':') {
-                                flags &= ~flag_need_colon;
-                                continue;
-                            } else {
-                                std::sprintf(error,
-                                             "%d:%d: Expected : before %c",
-                                             LINE_AND_COL, b);
-                                goto e_failed;
-                            }
-                        }
+}
 
-                        flags &= ~flag_seek_value;
+namespace json {
+    // Checks syntax of the input the same way as the first pass of json::parse does, but
+    // without allocating. If `value_end` is set, stops after the first complete value and
+    // stores where it ended, otherwise the whole input must be a single value. Offset of
+    // the error is from `json`.
+    static bool scan(const json::settings &settings, const char *json, const char *end,
+                     const char **value_end, json::parse_error *error) noexcept;
+}
 
-                        switch (b) {
-                            case '{':
-                                if (!new_value(&state, &top, &root, &alloc, json_object))
-                                    goto e_alloc_failure;
+namespace {
+    // Finds line and column of error.offset, which is only done once parsing failed, so
+    // that lines do not need to be counted while parsing
+    void locate(json::parse_error &error, const char *input) noexcept {
+        const char *const at = input + error.offset;
+        const char *line = input;
+        error.line = 1;
 
-                                continue;
+        for (const char *ptr = input; (ptr = (const char *) std::memchr(ptr, '\n', at - ptr)); line = ++ptr)
+            ++error.line;
 
-                            case '[':
-                                if (!new_value(&state, &top, &root, &alloc, json_array))
-                                    goto e_alloc_failure;
+        error.col = at - line + 1;
+    }
+}
 
-                                flags |= flag_seek_value;
-                                continue;
+#define WHITESPACE \
+    case '\n': case ' ': case '\t': case '\r'
 
-                            case '"':
-                                if (!new_value(&state, &top, &root, &alloc, json_string))
-                                    goto e_alloc_failure;
+#define STRING_ADD(b)  \
+    do { if (!first_pass) string [string_length] = b;  ++ string_length; } while (0)
 
-                                flags |= flag_string;
-                                string = top->u.string.ptr;
-                                string_length = 0;
-                                continue;
+#define FAIL(error_code, c) \
+    do { error.code = error_code;  error.character = c;  goto e_failed; } while (0)
 
-                            case 't':
-                                if ((end - state.ptr) < 3 ||
-                                    *(++state.ptr) != 'r' ||
-                                    *(++state.ptr) != 'u' ||
-                                    *(++state.ptr) != 'e') {
-                                    goto e_unknown_value;
-                                }
+namespace {
+    // Everything json::parse needs to stop after any character of the input and resume later
+    struct parse_context {
+        json_state state;
+        const char *input, *json, *end;
+        json_value *top, *root, *alloc;
+
+        long flags;
+        char *string;
+        unsigned int string_length;
+        unsigned int depth;
+        unsigned long values;
+
+        unsigned int features;  // which instantiation of parse_pass to run
+        bool resume;  // in the middle of a pass
+    };
 
-                                if (!new_value(&state, &top, &root, &alloc, json_boolean))
-                                    goto e_alloc_failure;
+    enum parse_status {
+        parse_done,
+        parse_failed,
+        parse_suspended,
+    };
 
-                                top->u.boolean = true;
-                                flags |= flag_next;
-                                break;
+    // Prepares parsing [json, end), reporting offsets from `input`
+    void parse_begin(parse_context &ctx, const json::settings &settings,
+                     const char *input, const char *json, const char *end) noexcept
+    {
+        ctx = parse_context();
+        ctx.input = input;
+        ctx.json = json;
+        ctx.end = end;
+        ctx.features = select_features(settings);
+
+        json_state &state = ctx.state;
+        state.settings = settings;
+#ifdef __AVX__
+        // The copies above may use 256-bit moves, after which GCC does not always clear the
+        // upper halves of the registers; left dirty, they make all later SSE code (libc too)
+        // several times slower
+        _mm256_zeroupper();
+#endif
+#ifdef JSON_TRACK_SPAN
+        state.input = ctx.input;
+#endif
 
-                            case 'f':
-                                if ((end - state.ptr) < 4 ||
-                                    *(++state.ptr) != 'a' ||
-                                    *(++state.ptr) != 'l' ||
-                                    *(++state.ptr) != 's' ||
-                                    *(++state.ptr) != 'e') {
-                                    goto e_unknown_value;
-                                }
+        default_allocator(state.settings);
 
-                                if (!new_value(&state, &top, &root, &alloc, json_boolean))
-                                    goto e_alloc_failure;
+        // limit of how much can be added before next check
+        state.uint_max = std::numeric_limits<decltype(state.uint_max)>::max() - 8;
+        state.ulong_max = std::numeric_limits<decltype(state.ulong_max)>::max() - 8;
 
-                                flags |= flag_next;
-                                break;
+        state.string_max = state.uint_max;
+        if (settings.max_string_length && settings.max_string_length < state.string_max)
+            state.string_max = settings.max_string_length;
 
-                            case 'n':
-                                if ((end - state.ptr) < 3 ||
-                                    *(++state.ptr) != 'u' ||
-                                    *(++state.ptr) != 'l' ||
-                                    *(++state.ptr) != 'l') {
-                                    goto e_unknown_value;
-                                }
+        state.hash.reset(settings.hash_ordered);
+        state.first_pass = 1;
 
-                                if (!new_value(&state, &top, &root, &alloc, json_null))
-                                    goto e_alloc_failure;
+        state.counted = state.line_start = ctx.input;
+        state.cur_line = 1;
+    }
 
-                                flags |= flag_next;
-                                break;
+    // Releases everything allocated by parse_run which did not finish
+    void parse_abandon(parse_context &ctx) noexcept
+    {
+        json_state &state = ctx.state;
+        json_value *alloc = ctx.alloc;
+
+        if (state.first_pass) {
+            alloc = ctx.root;
+        } else if (ctx.root) {
+            // values of the second pass are attached to their parents only once complete,
+            // so attach those still open to make all of them reachable from the root
+            for (json_value *value = ctx.top; value && value->parent; value = value->parent) {
+                json_value *parent = value->parent;
+                if (parent->type == json::json_object)
+                    parent->u.object.values[parent->u.object.length++].value = value;
+                else
+                    parent->u.array.values[parent->u.array.length++] = value;
+            }
+        }
 
-                            default:
-                                if (std::isdigit(b) || b == '-') {
-                                    if (!new_value(&state, &top, &root, &alloc, json_integer))
-                                        goto e_alloc_failure;
-
-                                    if (!state.first_pass) {
-                                        while (std::isdigit(b) ||
-                                               b == '+' ||
-                                               b == '-' ||
-                                               b == 'e' ||
-                                               b == 'E' ||
-                                               b == '.') {
-                                            if ((++state.ptr) == end) {
-                                                b = 0;
-                                                break;
-                                            }
-
-                                            b = *state.ptr;
-                                        }
+        while (alloc) {
+            json_value *next = alloc->_reserved.next_alloc;
+            state.settings.mem_free(alloc, state.settings.user_data);
+            alloc = next;
+        }
 
-                                        flags |= flag_next | flag_reproc;
-                                        break;
-                                    }
+        if (!state.first_pass)
+            json::value_free(state.settings, reinterpret_cast<json::value*>(ctx.root));
 
-                                    flags &= ~(flag_num_negative | flag_num_e |
-                                               flag_num_e_got_sign | flag_num_e_negative |
-                                               flag_num_zero);
+        ctx.root = nullptr;
+    }
+}
 
-                                    num_digits = 0;
-                                    num_fraction = 0;
-                                    num_e = 0;
+namespace json {
+    // Runs the current pass over up to about `budget` bytes of input (then reduced by what was
+    // read), unless the pass ends first. Options not in `features` are left out at compile time.
+    template<unsigned int features>
+    static parse_status parse_pass(parse_context &ctx, std::size_t &budget, json::parse_error &error) noexcept;
+
+    template<unsigned int features>
+    static parse_status parse_passes(parse_context &ctx, std::size_t budget, json::parse_error &error) noexcept {
+        if (ctx.state.first_pass > 0) {
+            const parse_status status = parse_pass<features | feature_first_pass>(ctx, budget, error);
+            if (status != parse_done)
+                return status;
+        }
 
-                                    if (b != '-') {
-                                        flags |= flag_reproc;
-                                        break;
-                                    }
+        return parse_pass<features>(ctx, budget, error);
+    }
 
-                                    flags |= flag_num_negative;
-                                    continue;
-                                } else {
-                                    std::sprintf(error,
-                                                 "%d:%d: Unexpected %c when seeking value",
-                                                 LINE_AND_COL, b);
-                                    goto e_failed;
-                                }
-                        }
-                }
-            } else {
-                switch (top->type) {
-                    case json_object:
-                        switch (b) {
-                            WHITESPACE:
-                                continue;
+    // Parses up to about `budget` bytes of input (counted over both passes), unless done first
+    static parse_status parse_run(parse_context &ctx, std::size_t budget, json::parse_error &error) noexcept {
+        switch (ctx.features) {
+            case features_none: return parse_passes<features_none>(ctx, budget, error);
+            case features_comments: return parse_passes<features_comments>(ctx, budget, error);
+            case features_json5: return parse_passes<features_json5>(ctx, budget, error);
+            case features_untrusted: return parse_passes<features_untrusted>(ctx, budget, error);
+            case features_exact: return parse_passes<features_exact>(ctx, budget, error);
+            default: return parse_passes<features_all>(ctx, budget, error);
+        }
+    }
+}
 
-                            case '"':
-                                if (flags & flag_need_comma) {
-                                    std::sprintf(error,
-                                                 "%d:%d: Expected , before \"",
-                                                 LINE_AND_COL);
-                                    goto e_failed;
-                                }
+namespace {
+    // Ends name of the next member of `object` of `length` bytes, written (in the second pass)
+    // at its object_mem
+    void end_name(json_value *object, unsigned int length, bool first_pass) noexcept {
+        if (first_pass) {
+            (*(char **) &object->u.object.values) += length + 1;
+            return;
+        }
 
-                                flags |= flag_string;
-                                string = (char *) top->_reserved.object_mem;
-                                string_length = 0;
-                                break;
+        object->u.object.values[object->u.object.length].name = (char *) object->_reserved.object_mem;
+        object->u.object.values[object->u.object.length].name_length = length;
+        (*(char **) &object->_reserved.object_mem) += length + 1;
+    }
+}
 
-                            case '}':
-                                flags = (flags & ~flag_need_comma) | flag_next;
-                                break;
+template<unsigned int features>
+parse_status json::parse_pass(parse_context & ctx, size_t & budget, json::parse_error & error) noexcept
+{
+    constexpr bool first_pass = features & feature_first_pass;
+    constexpr bool limits = features & feature_limits;
+    constexpr bool scan = features & feature_scan;
+
+    json_state &state = ctx.state;
+    const bool json5 = (features & feature_json5) && state.settings.json5;
+    const bool comments = (features & feature_comments) && (json5 || state.settings.allow_comments);
+    const bool strict_utf8 = (features & feature_strict_utf8) && state.settings.strict_utf8;
+    const bool hash = !first_pass && (features & feature_hash) && state.settings.hash;
+    const bool exact_numbers = (features & feature_exact_numbers) && state.settings.exact_numbers;
+
+    const char *const input = ctx.input;
+    const char *const json = ctx.json;
+    const char *const end = ctx.end;
+
+    json_value *top = ctx.top, *root = ctx.root, *alloc = ctx.alloc;
+    long flags = ctx.flags;
+    char *string = ctx.string;
+    unsigned int string_length = ctx.string_length;
+    unsigned int depth = ctx.depth;
+    unsigned long values = ctx.values;
+
+    if (!ctx.resume) {
+        top = root = nullptr;
+        flags = flag_seek_value;
+        string = nullptr;
+        string_length = 0;
+        depth = 0;
+        values = 0;
+        state.ptr = json;
+    }
 
-                            case ',':
-                                if (flags & flag_need_comma) {
-                                    flags &= ~flag_need_comma;
-                                    break;
-                                }
+    ctx.resume = false;
+    const char *const start = state.ptr;
+    const char *const limit = budget < std::size_t(end - start) ? start + budget : end;
 
-                            default:
-                                std::sprintf(error,
-                                             "%d:%d: Unexpected `%c` in object",
-                                             LINE_AND_COL, b);
-                                goto e_failed;
-                        }
+    for (;; ++state.ptr) {
+        if (state.ptr >= limit && limit != end)
+            goto suspend;
 
+        char b = (state.ptr == end ? 0 : *state.ptr);
 
-                        break;
+        if (flags & flag_string) {
+            if (!b)
+                FAIL(json::error_eof_in_string, 0);
 
-                    case json_integer:
-                    case json_double:
-                        if (std::isdigit(b)) {
-                            ++num_digits;
-
-                            if (top->type == json_integer || flags & flag_num_e) {
-                                if (!(flags & flag_num_e)) {
-                                    if (flags & flag_num_zero) {
-                                        std::sprintf(error,
-                                                     "%d:%d: Unexpected `0` before `%c`",
-                                                     LINE_AND_COL, b);
-                                        goto e_failed;
-                                    }
+            if (string_length > state.string_max)
+                goto e_string_too_long;
 
-                                    if (num_digits == 1 && b == '0')
-                                        flags |= flag_num_zero;
-                                } else {
-                                    flags |= flag_num_e_got_sign;
-                                    num_e = (num_e * 10) + (b - '0');
-                                    continue;
-                                }
+            if (flags & flag_escaped) {
+                flags &= ~flag_escaped;
+                unsigned char uc_b1, uc_b2, uc_b3, uc_b4;
+                uint32_t uchar;
 
-                                top->u.integer = (top->u.integer * 10) + (b - '0');
-                                continue;
+                if (json5) {
+                    switch (b) {
+                        case '\'': STRING_ADD('\''); continue;
+                        case 'v': STRING_ADD('\v'); continue;
+                        case '0':
+                            if (end - state.ptr > 1 && std::isdigit(state.ptr[1]))
+                                FAIL(json::error_invalid_character, b);
+
+                            STRING_ADD(0);
+                            continue;
+
+                        case 'x':
+                            if (end - state.ptr <= 2 ||
+                                (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
+                                (uc_b2 = hex_value(*++state.ptr)) == 0xFF) {
+                                FAIL(json::error_invalid_character, b);
+                            }
+
+                            uc_b1 = (uc_b1 << 4) | uc_b2;
+                            if (uc_b1 <= 0x7F) {
+                                STRING_ADD((char) uc_b1);
+                            } else {
+                                STRING_ADD((char) (0xC0 | (uc_b1 >> 6)));
+                                STRING_ADD((char) (0x80 | (uc_b1 & 0x3F)));
                             }
 
-                            num_fraction = (num_fraction * 10) + (b - '0');
                             continue;
+
+                        case '\r':  // line continuation
+                            if (end - state.ptr > 1 && state.ptr[1] == '\n')
+                                ++state.ptr;
+                            continue;
+
+                        case '\n':
+                            continue;
+
+                        default:
+                            break;
+                    }
+                }
+
+                switch (b) {
+                    case 'b': STRING_ADD('\b'); break;
+                    case 'f': STRING_ADD('\f'); break;
+                    case 'n': STRING_ADD('\n'); break;
+                    case 'r': STRING_ADD('\r'); break;
+                    case 't': STRING_ADD('\t'); break;
+                    case 'u':
+                        if (end - state.ptr <= 4 ||
+                            (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
+                            (uc_b2 = hex_value(*++state.ptr)) == 0xFF ||
+                            (uc_b3 = hex_value(*++state.ptr)) == 0xFF ||
+                            (uc_b4 = hex_value(*++state.ptr)) == 0xFF) {
+                            FAIL(json::error_invalid_character, b);
                         }
 
-                        if (b == '+' || b == '-') {
-                            if ((flags & flag_num_e) && !(flags & flag_num_e_got_sign)) {
-                                flags |= flag_num_e_got_sign;
+                        uc_b1 = (uc_b1 << 4) | uc_b2;
+                        uc_b2 = (uc_b3 << 4) | uc_b4;
+                        uchar = (uc_b1 << 8) | uc_b2;
 
-                                if (b == '-')
-                                    flags |= flag_num_e_negative;
-                                continue;
+                        if ((uchar & 0xF800) == 0xD800) {
+                            if (end - state.ptr <= 6 ||
+                                (*++state.ptr) != '\\' ||
+                                (*++state.ptr) != 'u' ||
+                                (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
+                                (uc_b2 = hex_value(*++state.ptr)) == 0xFF ||
+                                (uc_b3 = hex_value(*++state.ptr)) == 0xFF ||
+                                (uc_b4 = hex_value(*++state.ptr)) == 0xFF) {
+                                FAIL(json::error_invalid_character, b);
                             }
-                        } else if (b == '.' && top->type == json_integer) {
-                            if (!num_digits) {
-                                std::sprintf(error,
-                                             "%d:%d: Expected digit before `.`",
-                                             LINE_AND_COL);
-                                goto e_failed;
+
+                            uc_b1 = (uc_b1 << 4) | uc_b2;
+                            uc_b2 = (uc_b3 << 4) | uc_b4;
+                            const uint32_t uchar2 = (uc_b1 << 8) | uc_b2;
+
+                            if (strict_utf8
+                                && ((uchar & 0xFC00) != 0xD800 || (uchar2 & 0xFC00) != 0xDC00)) {
+                                FAIL(json::error_invalid_surrogate, 0);
                             }
 
-                            top->type = json_double;
-                            top->u.dbl = (double) top->u.integer;
-                            num_digits = 0;
-                            continue;
+                            uchar = 0x010000 | ((uchar & 0x3FF) << 10) | (uchar2 & 0x3FF);
                         }
 
-                        if (!(flags & flag_num_e)) {
-                            if (top->type == json_double) {
-                                if (!num_digits) {
-                                    std::sprintf(error,
-                                                 "%d:%d: Expected digit after `.`",
-                                                 LINE_AND_COL);
-                                    goto e_failed;
-                                }
+                        if (uchar <= 0x7F) {
+                            STRING_ADD((char) uchar);
+                            break;
+                        }
 
-                                top->u.dbl +=
-                                        ((double) num_fraction) /
-                                        (std::pow(10.0, (double) num_digits));
+                        if (uchar <= 0x7FF) {
+                            if (first_pass)
+                                string_length += 2;
+                            else {
+                                string[string_length++] = 0xC0 | (uchar >> 6);
+                                string[string_length++] = 0x80 | (uchar & 0x3F);
                             }
 
-                            if (b == 'e' || b == 'E') {
-                                flags |= flag_num_e;
-                                if (top->type == json_integer) {
-                                    top->type = json_double;
-                                    top->u.dbl = (double) top->u.integer;
-                                }
+                            break;
+                        }
 
-                                num_digits = 0;
-                                flags &= ~flag_num_zero;
-                                continue;
-                            }
-                        } else {
-                            if (!num_digits) {
-                                std::sprintf(error,
-                                             "%d:%d: Expected digit after `e`",
-                                             LINE_AND_COL);
-                                goto e_failed;
+                        if (uchar <= 0xFFFF) {
+                            if (first_pass)
+                                string_length += 3;
+                            else {
+                                string[string_length++] = 0xE0 | (uchar >> 12);
+                                string[string_length++] = 0x80 | ((uchar >> 6) & 0x3F);
+                                string[string_length++] = 0x80 | (uchar & 0x3F);
                             }
 
-                            top->u.dbl *= std::pow(10.0, (double)
-                                    (flags & flag_num_e_negative ? -num_e : num_e));
+                            break;
                         }
 
-                        if (flags & flag_num_negative) {
-                            if (top->type == json_integer)
-                                top->u.integer = -top->u.integer;
-                            else
-                                top->u.dbl = -top->u.dbl;
+                        if (first_pass)
+                            string_length += 4;
+                        else {
+                            string[string_length++] = 0xF0 | (uchar >> 18);
+                            string[string_length++] = 0x80 | ((uchar >> 12) & 0x3F);
+                            string[string_length++] = 0x80 | ((uchar >> 6) & 0x3F);
+                            string[string_length++] = 0x80 | (uchar & 0x3F);
                         }
 
-                        flags |= flag_next | flag_reproc;
                         break;
 
-                    default:
+                    case '"': case '\\': case '/':
+                        STRING_ADD(b);
                         break;
+
+                    default:
+                        if (strict_utf8)
+                            FAIL(json::error_invalid_character, b);
+
+                        STRING_ADD(b);
                 }
+
+                continue;
             }
 
-            if (flags & flag_reproc) {
-                flags &= ~flag_reproc;
-                --state.ptr;
+            if (b == '\\') {
+                flags |= flag_escaped;
+                continue;
             }
 
-            if (flags & flag_next) {
-                flags = (flags & ~flag_next) | flag_need_comma;
+            if (b == (json5 && (flags & flag_single_quote) ? '\'' : '"')) {
+                if (!first_pass)
+                    string[string_length] = 0;
 
-                if (!top->parent) {
-                    // root value done
-                    flags |= flag_done;
-                    continue;
+                flags &= ~(flag_string | flag_single_quote);
+                string = nullptr;
+
+                switch (top->type) {
+                    case json_string:
+                        top->u.string.length = string_length;
+                        flags |= flag_next;
+                        break;
+
+                    case json_object:
+                        end_name(top, string_length, first_pass);
+                        flags |= flag_seek_value | flag_need_colon;
+                        continue;
+
+                    default:
+                        break;
+                }
+            } else {
+                if (strict_utf8 && ((unsigned char) b) < 0x20)
+                    goto e_control_char;
+
+                // take the whole run of characters which can be copied verbatim, but do
+                // not look further than the length limit
+                const std::size_t remaining = state.string_max - string_length;
+                const char *run = skip_string(state.ptr + 1,
+                                              std::size_t(end - state.ptr) > remaining + 1
+                                              ? state.ptr + remaining + 1 : end);
+
+                if (json5 && (flags & flag_single_quote)) {
+                    // the run goes on over double quotes, and must end at a single one
+                    if (const char *quote = (const char *) std::memchr(state.ptr, '\'', run - state.ptr))
+                        run = quote;
                 }
 
-                if (top->parent->type == json_array)
-                    flags |= flag_seek_value;
+                const std::size_t run_length = run - state.ptr;
 
-                if (!state.first_pass) {
-                    json_value *parent = top->parent;
+                if (run_length > remaining)
+                    goto e_string_too_long;
 
-                    switch (parent->type) {
-                        case json_object:
-                            parent->u.object.values
-                            [parent->u.object.length].value = top;
-                            break;
+                if (!first_pass)
+                    std::memcpy(string + string_length, state.ptr, run_length);
+                else if (strict_utf8 && !valid_utf8(state.ptr, run_length))
+                    goto e_invalid_utf8;
 
-                        case json_array:
-                            parent->u.array.values
-                            [parent->u.array.length] = top;
-                            break;
+                string_length += run_length;
+                state.ptr = run - 1;
+                continue;
+            }
+        }
 
-                        default:
-                            break;
+        if (comments) {
+            if (flags & (flag_line_comment | flag_block_comment)) {
+                if (flags & flag_line_comment) {
+                    if (b == '\r' || b == '\n' || !b) {
+                        flags &= ~flag_line_comment;
+                        --state.ptr;  // so null can be reproc'd
+                    }
+
+                    continue;
+                }
+
+                if (flags & flag_block_comment) {
+                    if (!b)
+                        FAIL(json::error_eof_in_comment, 0);
+
+                    if (b == '*' && state.ptr < (end - 1) && state.ptr[1] == '/') {
+                        flags &= ~flag_block_comment;
+                        ++state.ptr;  // skip closing sequence
                     }
+
+                    continue;
                 }
+            } else if (b == '/') {
+                if (!(flags & (flag_seek_value | flag_done)) && top->type != json_object)
+                    FAIL(json::error_comment_not_allowed, 0);
 
-                if ((++top->parent->u.array.length) > state.uint_max)
-                    goto e_overflow;
+                if (++state.ptr == end)
+                    FAIL(json::error_eof, 0);
 
-                top = top->parent;
-                continue;
+                switch (b = *state.ptr) {
+                    case '/':
+                        flags |= flag_line_comment;
+                        continue;
+
+                    case '*':
+                        flags |= flag_block_comment;
+                        continue;
+
+                    default:
+                        FAIL(json::error_comment_opening, b);
+                }
             }
         }
 
-        alloc = root;
-    }
+        if (flags & flag_done) {
+            if (!b)
+                break;
 
-    return reinterpret_cast<json::value*>(root);
+            switch (b) {
+                WHITESPACE:
+                    continue;
 
-    e_unknown_value:
-    std::sprintf(error, "%d:%d: Unknown value", LINE_AND_COL);
-    goto e_failed;
+                default:
+                    FAIL(json::error_trailing_garbage, b);
+            }
+        }
 
-    e_alloc_failure:
-    std::strcpy(error, "Memory allocation failure");
-    goto e_failed;
+        if (flags & flag_seek_value) {
+            switch (b) {
+                WHITESPACE:
+                    continue;
 
-    e_overflow:
-    std::sprintf(error, "%d:%d: Too long (caught overflow)", LINE_AND_COL);
-    goto e_failed;
+                case ']':
+                    if (top && top->type == json_array)
+                        flags = (flags & ~(flag_need_comma | flag_seek_value)) | flag_next;
+                    else
+                        FAIL(json::error_unexpected_bracket, 0);
 
-    e_failed:
-    if (error_buf) {
-        if (*error)
-            std::strcpy(error_buf, error);
-        else
-            std::strcpy(error_buf, "Unknown error");
-    }
+                    break;
 
-    if (state.first_pass)
-        alloc = root;
+                default:
+                    if (flags & flag_need_comma) {
+                        if (b == ',') {
+                            flags &= ~flag_need_comma;
+                            continue;
+                        } else
+                            FAIL(json::error_expected_comma, b);
+                    }
 
-    while (alloc) {
-        top = alloc->_reserved.next_alloc;
-        state.settings.mem_free(alloc, state.settings.user_data);
-        alloc = top;
-    }
+                    if (flags & flag_need_colon) {
+                        if (b == ':') {
+                            flags &= ~flag_need_colon;
+                            continue;
+                        } else
+                            FAIL(json::error_expected_colon, b);
+                    }
 
-    if (!state.first_pass)
-        json::value_free(state.settings, reinterpret_cast<json::value*>(root));
+                    if (limits && state.settings.max_values && ++values > state.settings.max_values)
+                        goto e_too_many_values;
 
-    return nullptr;
-}
+                    flags &= ~flag_seek_value;
+                    state.value_start = state.ptr;
 
-const json::value * json::parse(const char * json, size_t length) noexcept {
-    const json::settings settings = { 0 };
-    return json::parse(settings, json, length, 0);
-}
+                    switch (b) {
+                        case '{':
+                            if (limits && state.settings.max_depth && ++depth > state.settings.max_depth)
+                                goto e_too_deep;
 
-void json::value_free(const json::settings & settings, const json::value * val) noexcept
-{
-    if (!val)
-        return;
+                            if (!new_value<features>(&state, &top, &root, &alloc, json_object))
+                                goto e_alloc_failure;
 
-    json_value* value = reinterpret_cast<json_value*>(const_cast<json::value*>(val));
-    value->parent = nullptr;
-    json_value *cur_value;
-    while (value) {
-        switch (value->type) {
-            case json_array:
-                if (!value->u.array.length) {
-                    settings.mem_free(value->u.array.values, settings.user_data);
-                    break;
-                }
+                            continue;
 
-                value = value->u.array.values[--value->u.array.length];
-                continue;
+                        case '[':
+                            if (limits && state.settings.max_depth && ++depth > state.settings.max_depth)
+                                goto e_too_deep;
 
-            case json_object:
-                if (!value->u.object.length) {
-                    settings.mem_free(value->u.object.values, settings.user_data);
-                    break;
-                }
+                            if (!new_value<features>(&state, &top, &root, &alloc, json_array))
+                                goto e_alloc_failure;
 
-                value = value->u.object.values[--value->u.object.length].value;
-                continue;
+                            flags |= flag_seek_value;
+                            continue;
 
-            case json_string:
-                settings.mem_free(value->u.string.ptr, settings.user_data);
-                break;
+                        case '\'':
+                            if (!json5)
+                                FAIL(json::error_unexpected_value, b);
 
-            default:
-                break;
-        }
+                            flags |= flag_single_quote;
+                            // fall through
 
-        cur_value = value;
-        value = value->parent;
-        settings.mem_free(cur_value, settings.user_data);
-    }
-}
+                        case '"':
+                            if (!new_value<features>(&state, &top, &root, &alloc, json_string))
+                                goto e_alloc_failure;
 
-void json::value_free(const json::value * value) noexcept {
-    json::settings settings = {0};
-    settings.mem_free = default_free;
-    json::value_free(settings, value);
+                            flags |= flag_string;
+                            string = top->u.string.ptr;
+                            string_length = 0;
+                            continue;
+
+                        case 't':
+                            if ((end - state.ptr) < 3 ||
+                                *(++state.ptr) != 'r' ||
+                                *(++state.ptr) != 'u' ||
+                                *(++state.ptr) != 'e') {
+                                goto e_unknown_value;
+                            }
+
+                            if (!new_value<features>(&state, &top, &root, &alloc, json_boolean))
+                                goto e_alloc_failure;
+
+                            top->u.boolean = true;
+                            flags |= flag_next;
+                            break;
+
+                        case 'f':
+                            if ((end - state.ptr) < 4 ||
+                                *(++state.ptr) != 'a' ||
+                                *(++state.ptr) != 'l' ||
+                                *(++state.ptr) != 's' ||
+                                *(++state.ptr) != 'e') {
+                                goto e_unknown_value;
+                            }
+
+                            if (!new_value<features>(&state, &top, &root, &alloc, json_boolean))
+                                goto e_alloc_failure;
+
+                            flags |= flag_next;
+                            break;
+
+                        case 'n':
+                            if ((end - state.ptr) < 3 ||
+                                *(++state.ptr) != 'u' ||
+                                *(++state.ptr) != 'l' ||
+                                *(++state.ptr) != 'l') {
+                                goto e_unknown_value;
+                            }
+
+                            if (!new_value<features>(&state, &top, &root, &alloc, json_null))
+                                goto e_alloc_failure;
+
+                            flags |= flag_next;
+                            break;
+
+                        default:
+                            if (json5 && (std::isdigit(b) || b == '-' || b == '+' || b == '.'
+                                          || b == 'I' || b == 'N')) {
+                                if (!new_value<features>(&state, &top, &root, &alloc, json_integer))
+                                    goto e_alloc_failure;
+
+                                // the whole number at once, so the second pass only skips it
+                                const char *number_end = json5_number(state.ptr, end,
+                                                                      first_pass && !scan ? top : nullptr);
+                                if (!number_end)
+                                    FAIL(json::error_invalid_number, 0);
+
+                                if (limits && state.settings.max_number_length
+                                    && std::size_t(number_end - state.ptr) > state.settings.max_number_length) {
+                                    goto e_number_too_long;
+                                }
+
+                                state.ptr = number_end - 1;
+                                flags |= flag_next;
+                                break;
+                            }
+
+                            if (std::isdigit(b) || b == '-') {
+                                if (!new_value<features>(&state, &top, &root, &alloc,
+                                                         exact_numbers ? json_number : json_integer))
+                                    goto e_alloc_failure;
+
+                                if (!first_pass) {
+                                    while (std::isdigit(b) ||
+                                           b == '+' ||
+                                           b == '-' ||
+                                           b == 'e' ||
+                                           b == 'E' ||
+                                           b == '.') {
+                                        if ((++state.ptr) == end) {
+                                            b = 0;
+                                            break;
+                                        }
+
+                                        b = *state.ptr;
+                                    }
+
+                                    flags |= flag_next | flag_reproc;
+                                    break;
+                                }
+
+                                // the whole number at once, so that it is converted like everywhere
+                                // else (see convert_number), or kept as text
+                                const char *const number = state.ptr;
+                                json::error_code code;
+                                const char *const number_end = skip_number(number, end, code);
+
+                                if (limits && state.settings.max_number_length
+                                    && std::size_t(number_end - number) > state.settings.max_number_length) {
+                                    state.ptr += state.settings.max_number_length + 1;
+                                    goto e_number_too_long;
+                                }
+
+                                state.ptr = number_end;
+                                if (code != json::error_none)
+                                    FAIL(code, code == json::error_leading_zero ? *state.ptr : 0);
+
+                                if (exact_numbers) {
+                                    if (std::size_t(number_end - number) > state.uint_max)
+                                        goto e_overflow;
+
+                                    top->u.number.length = number_end - number;
+                                    top->u.number.ptr = number;
+                                } else if (!scan) {
+                                    top->type = convert_number(number, number_end, top->u.integer, top->u.dbl);
+                                }
+
+                                flags |= flag_next | flag_reproc;
+                                break;
+                            } else
+                                FAIL(json::error_unexpected_value, b);
+                    }
+            }
+        } else {
+            switch (top->type) {
+                case json_object:
+                    switch (b) {
+                        WHITESPACE:
+                            continue;
+
+                        case '\'':
+                            if (!json5)
+                                FAIL(json::error_unexpected_in_object, b);
+
+                            if (flags & flag_need_comma)
+                                FAIL(json::error_expected_comma, b);
+
+                            flags |= flag_single_quote;
+                            // fall through
+
+                        case '"':
+                            if (flags & flag_need_comma)
+                                FAIL(json::error_expected_comma, '"');
+
+                            flags |= flag_string;
+                            string = (char *) top->_reserved.object_mem;
+                            string_length = 0;
+                            break;
+
+                        case '}':
+                            flags = (flags & ~flag_need_comma) | flag_next;
+                            break;
+
+                        case ',':
+                            if (flags & flag_need_comma) {
+                                flags &= ~flag_need_comma;
+                                break;
+                            }
+
+                            FAIL(json::error_unexpected_in_object, b);
+
+                        default:
+                            if (json5 && identifier_start(b)) {
+                                if (flags & flag_need_comma)
+                                    FAIL(json::error_expected_comma, b);
+
+                                const char *name_end = skip_identifier(state.ptr, end);
+                                const std::size_t length = name_end - state.ptr;
+
+                                if (length > state.string_max)
+                                    goto e_string_too_long;
+
+                                if (first_pass) {
+                                    if (strict_utf8 && !valid_utf8(state.ptr, length))
+                                        goto e_invalid_utf8;
+                                } else {
+                                    string = (char *) top->_reserved.object_mem;
+                                    std::memcpy(string, state.ptr, length);
+                                    string[length] = 0;
+                                    string = nullptr;
+                                }
+
+                                end_name(top, length, first_pass);
+                                state.ptr = name_end - 1;
+                                flags |= flag_seek_value | flag_need_colon;
+                                continue;
+                            }
+
+                            FAIL(json::error_unexpected_in_object, b);
+                    }
+
+
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        if (flags & flag_reproc) {
+            flags &= ~flag_reproc;
+            --state.ptr;
+        }
+
+        if (flags & flag_next) {
+            flags = (flags & ~flag_next) | flag_need_comma;
+
+            if (limits && state.settings.max_depth && (top->type == json_object || top->type == json_array))
+                --depth;
+
+            if (scan) {
+                scan_stack &stack = *state.scan;
+                if (top->type == json_object || top->type == json_array)
+                    --stack.depth;
+
+                if (!stack.depth) {
+                    // root value done
+                    if (stack.stop) {
+                        stack.value_end = state.ptr + 1;
+                        return parse_done;
+                    }
+
+                    flags |= flag_done;
+                    continue;
+                }
+
+                top->type = stack.container(stack.depth - 1);
+                if (top->type == json_array)
+                    flags |= flag_seek_value;
+
+                if (limits && state.settings.max_elements
+                    && ++stack.elements[stack.depth - 1] > state.settings.max_elements) {
+                    goto e_too_many_elements;
+                }
+
+                continue;
+            }
+
+#ifdef JSON_TRACK_SPAN
+            if (first_pass)
+                top->length = state.ptr + 1 - (state.input + top->offset);
+#endif
+
+            // leave nothing behind in completed values, json::document relies on it
+            if (!first_pass && top->type == json_object)
+                top->_reserved.object_mem = nullptr;
+
+            if (hash) {
+                state.hash.add(reinterpret_cast<json::value *>(top));
+                if (top->parent) {
+                    state.hash.leave(reinterpret_cast<json::value *>(top->parent),
+                                     top->parent->u.array.length);
+                }
+            }
+
+            if (!top->parent) {
+                // root value done
+                flags |= flag_done;
+                continue;
+            }
+
+            if (top->parent->type == json_array)
+                flags |= flag_seek_value;
+
+            if (!first_pass) {
+                json_value *parent = top->parent;
+
+                switch (parent->type) {
+                    case json_object:
+                        parent->u.object.values
+                        [parent->u.object.length].value = top;
+                        break;
+
+                    case json_array:
+                        parent->u.array.values
+                        [parent->u.array.length] = top;
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+
+            if ((++top->parent->u.array.length) > state.uint_max)
+                goto e_overflow;
+
+            if (limits && state.settings.max_elements
+                && top->parent->u.array.length > state.settings.max_elements) {
+                goto e_too_many_elements;
+            }
+
+            top = top->parent;
+            continue;
+        }
+    }
+
+    budget -= std::min(budget, std::size_t(state.ptr - start));
+    --state.first_pass;
+
+    if (first_pass) {
+        ctx.alloc = root;  // the second pass takes the values in the same order
+        return parse_done;
+    }
+
+    if (hash)
+        *state.settings.hash = state.hash.result();
+
+    ctx.root = root;
+    return parse_done;
+
+    suspend:
+    ctx.top = top;
+    ctx.root = root;
+    ctx.alloc = alloc;
+    ctx.flags = flags;
+    ctx.string = string;
+    ctx.string_length = string_length;
+    ctx.depth = depth;
+    ctx.values = values;
+    ctx.resume = true;
+    return parse_suspended;
+
+    e_unknown_value:
+    FAIL(json::error_unknown_value, 0);
+
+    e_alloc_failure:
+    if (scan)  // nothing is allocated, but the stack of open containers is full
+        goto e_too_deep;
+
+    FAIL(json::error_memory, 0);
+
+    e_control_char:
+    FAIL(json::error_control_char, 0);
+
+    e_invalid_utf8:
+    FAIL(json::error_invalid_utf8, 0);
+
+    e_too_deep:
+    FAIL(json::error_too_deep, 0);
+
+    e_too_many_values:
+    FAIL(json::error_too_many_values, 0);
+
+    e_too_many_elements:
+    FAIL(json::error_too_many_elements, 0);
+
+    e_number_too_long:
+    FAIL(json::error_number_too_long, 0);
+
+    e_string_too_long:
+    if (!state.settings.max_string_length)
+        goto e_overflow;
+
+    FAIL(json::error_string_too_long, 0);
+
+    e_overflow:
+    FAIL(json::error_overflow, 0);
+
+    e_failed:
+    error.offset = state.ptr - input;
+    locate(error, input);
+
+    if (!scan) {
+        ctx.top = top;
+        ctx.root = root;
+        ctx.alloc = alloc;
+        parse_abandon(ctx);
+    }
+
+    return parse_failed;
+}
+
+const json::value * json::parse(const json::settings & settings,
+                                const char * json,
+                                size_t length,
+                                json::parse_error & error) noexcept
+{
+    const char *const input = json;  // offsets are relative to it, including BOM
+    skip_bom(json, length);
+
+    parse_context ctx;
+    parse_begin(ctx, settings, input, json, json + length);
+
+    if (json::parse_run(ctx, std::numeric_limits<std::size_t>::max(), error) != parse_done)
+        return nullptr;
+
+    return reinterpret_cast<json::value*>(ctx.root);
+}
+
+const json::value * json::parse(const json::settings & settings,
+                                const char * json,
+                                size_t length,
+                                char * error_buf) noexcept
+{
+    json::parse_error error;
+    const json::value *value = json::parse(settings, json, length, error);
+
+    if (!value && error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return value;
+}
+
+std::size_t json::to_string(const json::parse_error & error, char * buffer, size_t size) noexcept
+{
+    // message around the offending character, if any
+    static const char *const messages[][2] = {
+        { "No error", nullptr },
+        { "Memory allocation failure", nullptr },
+        { "Unexpected EOF in string", nullptr },
+        { "Invalid character value `", "`" },
+        { "Invalid surrogate pair", nullptr },
+        { "Unexpected control character in string", nullptr },
+        { "Invalid UTF-8 in string", nullptr },
+        { "Unexpected EOF in block comment", nullptr },
+        { "Comment not allowed here", nullptr },
+        { "Unexpected `", "` in comment opening sequence" },
+        { "EOF unexpected", nullptr },
+        { "Trailing garbage: `", "`" },
+        { "Unexpected ]", nullptr },
+        { "Expected , before ", "" },
+        { "Expected : before ", "" },
+        { "Unexpected ", " when seeking value" },
+        { "Unexpected `", "` in object" },
+        { "Unknown value", nullptr },
+        { "Unexpected `0` before `", "`" },
+        { "Expected digit before `.`", nullptr },
+        { "Expected digit after `.`", nullptr },
+        { "Expected digit after `e`", nullptr },
+        { "Expected digit after `-`", nullptr },
+        { "Too deep", nullptr },
+        { "Too many values", nullptr },
+        { "Too many elements", nullptr },
+        { "Number too long", nullptr },
+        { "String too long", nullptr },
+        { "Too long (caught overflow)", nullptr },
+        { "Invalid number", nullptr },
+        { "Expected array of records", nullptr },
+        { "Invalid column path", nullptr },
+        { "Invalid column type", nullptr },
+    };
+    static_assert(sizeof(messages) / sizeof(messages[0]) == json::error_invalid_column_type + 1);
+
+    json::writer out(buffer, size ? size - 1 : 0);
+    const auto &message = messages[error.code <= json::error_invalid_column_type ? error.code : 0];
+
+    // column errors are about the arguments rather than the input
+    if (error.code != json::error_none && error.code != json::error_memory
+        && error.code != json::error_invalid_column_path && error.code != json::error_invalid_column_type) {
+        json::write_unsigned(out, error.line);
+        out.put(':');
+        json::write_unsigned(out, error.col);
+        out.put(": ", 2);
+    }
+
+    out.put(message[0], std::strlen(message[0]));
+    if (message[1]) {
+        const unsigned char c = error.character;
+        if (!c) {
+            out.put("EOF", 3);
+        } else if (c < 0x20 || c >= 0x7F) {
+            char escaped[4] = { '\\', 'x', "0123456789ABCDEF"[c >> 4], "0123456789ABCDEF"[c & 0xF] };
+            out.put(escaped, 4);
+        } else
+            out.put(c);
+
+        out.put(message[1], std::strlen(message[1]));
+    }
+
+    if (size)
+        buffer[out.ptr - buffer] = '\0';
+
+    return out.length;
+}
+
+const json::value * json::parse(const char * json, size_t length) noexcept {
+    const json::settings settings = { 0 };
+    return json::parse(settings, json, length, 0);
+}
+
+struct json::parser::context {
+    parse_context parse;
+    parse_status status;
+};
+
+json::parser::parser(const json::settings & settings) noexcept
+        : settings(settings), ctx(nullptr), root_value(nullptr), failure()
+{
+    default_allocator(this->settings);
+}
+
+json::parser::parser(json::parser && other) noexcept
+        : settings(other.settings), ctx(other.ctx), root_value(other.root_value), failure(other.failure)
+{
+    other.ctx = nullptr;
+    other.root_value = nullptr;
+}
+
+json::parser & json::parser::operator=(json::parser && other) noexcept
+{
+    if (this != &other) {
+        clear();
+
+        if (ctx) {
+            ctx->~context();
+            settings.mem_free(ctx, settings.user_data);
+        }
+
+        settings = other.settings;
+        ctx = other.ctx;
+        root_value = other.root_value;
+        failure = other.failure;
+        other.ctx = nullptr;
+        other.root_value = nullptr;
+    }
+
+    return *this;
+}
+
+json::parser::~parser()
+{
+    clear();
+
+    if (ctx) {
+        ctx->~context();
+        settings.mem_free(ctx, settings.user_data);
+    }
+
+    ctx = nullptr;
+}
+
+void json::parser::clear() noexcept
+{
+    if (ctx && ctx->status == parse_suspended) {
+        parse_abandon(ctx->parse);
+        ctx->status = parse_failed;
+    }
+
+    json::value_free(settings, root_value);
+    root_value = nullptr;
+}
+
+bool json::parser::start(const char * json, size_t length) noexcept
+{
+    clear();
+    failure = json::parse_error();
+
+    if (!ctx) {
+        void *const mem = settings.mem_alloc(sizeof(context), false, settings.user_data);
+        if (!mem) {
+            failure.code = json::error_memory;
+            return false;
+        }
+
+        ctx = new (mem) context();
+    }
+
+    const char *const input = json;
+    skip_bom(json, length);
+
+    parse_begin(ctx->parse, settings, input, json, json + length);
+    ctx->status = parse_suspended;
+    return true;
+}
+
+bool json::parser::step(size_t budget) noexcept
+{
+    if (!ctx || ctx->status != parse_suspended)
+        return true;
+
+    ctx->status = json::parse_run(ctx->parse, budget ? budget : 1, failure);
+    if (ctx->status == parse_done)
+        root_value = reinterpret_cast<json::value*>(ctx->parse.root);
+
+    return ctx->status != parse_suspended;
+}
+
+const json::value * json::parser::release() noexcept
+{
+    const json::value *value = root_value;
+    root_value = nullptr;
+    return value;
+}
+
+bool json::scan(const json::settings & settings,
+                const char * json,
+                const char * end,
+                const char ** value_end,
+                json::parse_error * error_out) noexcept
+{
+    scan_stack stack;
+    stack.value = json_value();
+    stack.depth = 0;
+    stack.max_depth = settings.max_elements ? validate_max_counted_depth : validate_max_depth;
+    stack.stop = value_end;
+
+    if (settings.max_depth && settings.max_depth < stack.max_depth)
+        stack.max_depth = settings.max_depth;
+
+    parse_context ctx;
+    parse_begin(ctx, settings, json, json, end);
+    ctx.state.scan = &stack;
+
+    constexpr unsigned int scan = feature_first_pass | feature_scan;
+    std::size_t budget = std::numeric_limits<std::size_t>::max();
+    json::parse_error error;
+    parse_status status;
+
+    switch (ctx.features & ~(feature_track_source | feature_hash | feature_exact_numbers)) {
+        case features_none: status = parse_pass<features_none | scan>(ctx, budget, error); break;
+        case features_comments: status = parse_pass<features_comments | scan>(ctx, budget, error); break;
+        case features_json5: status = parse_pass<features_json5 | scan>(ctx, budget, error); break;
+        case features_untrusted: status = parse_pass<features_untrusted | scan>(ctx, budget, error); break;
+        default: status = parse_pass<features_all | scan>(ctx, budget, error);
+    }
+
+    if (status != parse_done) {
+        if (error_out)
+            *error_out = error;
+
+        return false;
+    }
+
+    if (value_end)
+        *value_end = stack.value_end;
+
+    return true;
+}
+
+bool json::validate(const json::settings & settings,
+                    const char * json,
+                    size_t length,
+                    json::parse_error & error) noexcept
+{
+    const char *const input = json;
+    skip_bom(json, length);
+
+    if (json::scan(settings, json, json + length, nullptr, &error))
+        return true;
+
+    error.offset += json - input;
+    locate(error, input);
+    return false;
+}
+
+bool json::validate(const json::settings & settings,
+                    const char * json,
+                    size_t length,
+                    char * error_buf) noexcept
+{
+    json::parse_error error;
+    if (json::validate(settings, json, length, error))
+        return true;
+
+    if (error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return false;
+}
+
+bool json::validate(const char * json, size_t length) noexcept {
+    const json::settings settings = { 0 };
+    return json::validate(settings, json, length, 0);
+}
+
+void json::value_free(const json::settings & settings, const json::value * val) noexcept
+{
+    if (!val)
+        return;
+
+    json_value* value = reinterpret_cast<json_value*>(const_cast<json::value*>(val));
+    value->parent = nullptr;
+    json_value *cur_value;
+    while (value) {
+        switch (value->type) {
+            case json_array:
+                if (!value->u.array.length) {
+                    settings.mem_free(value->u.array.values, settings.user_data);
+                    break;
+                }
+
+                value = value->u.array.values[--value->u.array.length];
+                continue;
+
+            case json_object:
+                if (!value->u.object.length) {
+                    settings.mem_free(value->u.object.values, settings.user_data);
+                    break;
+                }
+
+                value = value->u.object.values[--value->u.object.length].value;
+                continue;
+
+            case json_string:
+                settings.mem_free(value->u.string.ptr, settings.user_data);
+                break;
+
+            default:
+                break;
+        }
+
+        cur_value = value;
+        value = value->parent;
+        settings.mem_free(cur_value, settings.user_data);
+    }
+}
+
+void json::value_free(const json::value * value) noexcept {
+    json::settings settings = {0};
+    settings.mem_free = default_free;
+    json::value_free(settings, value);
+}
+
+void json::write_string(json::writer & out, const char * str, size_t length) noexcept
+{
+    const char *const end = str + length;
+    out.put('"');
+
+    while (str < end) {
+        // copy the longest run of characters which do not need escaping in one go
+        const char *run = skip_string(str, end);
+
+        out.put(str, run - str);
+        if (run == end)
+            break;
+
+        char escaped[6];
+        out.put(escaped, json::escape_char(*run, escaped));
+        str = run + 1;
+    }
+
+    out.put('"');
+}
+
+void json::write_integer(json::writer & out, int64_t value) noexcept
+{
+    char buffer[24];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.put(buffer, result.ptr - buffer);
+}
+
+void json::write_unsigned(json::writer & out, uint64_t value) noexcept
+{
+    char buffer[24];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.put(buffer, result.ptr - buffer);
+}
+
+void json::write_double(json::writer & out, double value) noexcept
+{
+    if (!std::isfinite(value)) {
+        out.put("null", 4);
+        return;
+    }
+
+    // shortest representation which parses back to the same value
+    char buffer[32];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer) - 2, value);
+    char *ptr = result.ptr;
+
+    // make sure json::parse will read it back as json_double rather than json_integer
+    if (!std::memchr(buffer, '.', ptr - buffer) && !std::memchr(buffer, 'e', ptr - buffer)) {
+        *ptr++ = '.';
+        *ptr++ = '0';
+    }
+
+    out.put(buffer, ptr - buffer);
+}
+
+const json::value * json::find(const json::value * object, const char * name, size_t length) noexcept
+{
+    if (!object || object->type != json_object)
+        return nullptr;
+
+    for (unsigned int i = 0; i < object->u.object.length; ++i) {
+        const json::object_entry &entry = object->u.object.values[i];
+        if (entry.name_length == length && !std::memcmp(entry.name, name, length))
+            return entry.value;
+    }
+
+    return nullptr;
+}
+
+bool json::to_integer(const json::value * value, int64_t & integer) noexcept
+{
+    json::value converted;
+    value = converted_number(value, converted);
+
+    switch (value->type) {
+        case json_integer:
+            integer = value->u.integer;
+            return true;
+
+        case json_double:
+            return integral(value->u.dbl, &integer);
+
+        default:
+            return false;
+    }
+}
+
+bool json::to_double(const json::value * value, double & dbl) noexcept
+{
+    json::value converted;
+    value = converted_number(value, converted);
+
+    switch (value->type) {
+        case json_integer:
+            dbl = (double) value->u.integer;
+            return true;
+
+        case json_double:
+            dbl = value->u.dbl;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+bool json::to_decimal(const json::value * value, json::decimal & decimal) noexcept
+{
+    if (value->type == json_integer) {
+        decimal.significand = value->u.integer;
+        decimal.exponent = 0;
+        return true;
+    }
+
+    if (value->type != json_number)
+        return false;
+
+    const char *ptr = value->u.number.ptr;
+    const char *const end = ptr + value->u.number.length;
+    const bool negative = ptr < end && *ptr == '-';
+    const uint64_t limit = uint64_t(std::numeric_limits<int64_t>::max()) + negative;
+    uint64_t significand = 0;
+    long exponent = 0;
+    bool fraction = false;
+
+    for (ptr += negative; ptr < end && *ptr != 'e' && *ptr != 'E'; ++ptr) {
+        if (*ptr == '.') {
+            fraction = true;
+            continue;
+        }
+
+        const unsigned int digit = *ptr - '0';
+        if (significand > (limit - digit) / 10)
+            return false;
+
+        significand = significand * 10 + digit;
+        exponent -= fraction;
+    }
+
+    if (ptr < end) {
+        const bool negative_exponent = ++ptr < end && *ptr == '-';
+        if (ptr < end && (*ptr == '+' || *ptr == '-'))
+            ++ptr;
+
+        long written = 0;
+        for (; ptr < end; ++ptr) {
+            if ((written = written * 10 + (*ptr - '0')) > std::numeric_limits<int>::max())
+                return false;
+        }
+
+        exponent += negative_exponent ? -written : written;
+    }
+
+    if (exponent < std::numeric_limits<int>::min() || exponent > std::numeric_limits<int>::max())
+        return false;
+
+    decimal.significand = int64_t(negative ? 0 - significand : significand);
+    decimal.exponent = int(exponent);
+    return true;
+}
+
+unsigned int json::walker::index_of(const json::value * child) noexcept
+{
+    const json::value *parent = child->parent;
+    unsigned int index = 0;
+
+    if (parent->type == json_object) {
+        while (parent->u.object.values[index].value != child)
+            ++index;
+    } else {
+        while (parent->u.array.values[index] != child)
+            ++index;
+    }
+
+    return index;
+}
+
+namespace {
+    // Indices of elements being visited in open containers, for iterative traversal of const
+    // trees. Deeper than the stack, the index is found by looking the value up in its parent
+    struct index_stack {
+        constexpr static unsigned int size = 64;
+        unsigned int indices[size];
+        unsigned int depth = 0;
+
+        void push(unsigned int index) noexcept {
+            if (depth < size)
+                indices[depth] = index;
+            ++depth;
+        }
+
+        // Returns index of `child` in its parent
+        unsigned int pop(const json::value *child) noexcept {
+            return --depth < size ? indices[depth] : json::walker::index_of(child);
+        }
+    };
+
+    // Writes a tree; with `prune` set, object members with null value are left out, except
+    // inside arrays (which is the result of applying it as a merge patch to nothing)
+    void write_tree(json::writer &out, const json::value *value, bool prune) noexcept {
+        if (!value) {
+            out.put("null", 4);
+            return;
+        }
+
+        unsigned int arrays = 0;  // open arrays, inside which nothing is pruned
+        bool comma = false;
+
+        for (json::walker walker(value); walker.next(); ) {
+            value = walker.value();
+
+            if (walker.leaving()) {
+                if (value->type == json::json_object) {
+                    out.put('}');
+                } else {
+                    out.put(']');
+                    --arrays;
+                }
+
+                comma = true;
+                continue;
+            }
+
+            const json::object_entry *member = walker.member();
+            if (member && prune && !arrays && value->type == json::json_null)
+                continue;
+
+            if (comma)
+                out.put(',');
+
+            if (member) {
+                json::write_string(out, member->name, member->name_length);
+                out.put(':');
+            }
+
+            comma = true;
+
+            switch (value->type) {
+                case json::json_object:
+                    out.put('{');
+                    comma = false;
+                    break;
+
+                case json::json_array:
+                    out.put('[');
+                    ++arrays;
+                    comma = false;
+                    break;
+
+                case json::json_integer:
+                    json::write_integer(out, value->u.integer);
+                    break;
+
+                case json::json_double:
+                    json::write_double(out, value->u.dbl);
+                    break;
+
+                case json::json_number:
+                    out.put(value->u.number.ptr, value->u.number.length);
+                    break;
+
+                case json::json_string:
+                    json::write_string(out, value->u.string.ptr, value->u.string.length);
+                    break;
+
+                case json::json_boolean:
+                    if (value->u.boolean)
+                        out.put("true", 4);
+                    else
+                        out.put("false", 5);
+                    break;
+
+                default:
+                    out.put("null", 4);
+                    break;
+            }
+        }
+    }
+}
+
+void json::write(json::writer & out, const json::value * value) noexcept
+{
+    write_tree(out, value, false);
+}
+
+namespace {
+    // Compares scalars, or only types of arrays and objects
+    bool same_value(const json::value *a, const json::value *b) noexcept {
+        json::value converted_a, converted_b;
+        int64_t integer;
+
+        a = converted_number(a, converted_a);
+        b = converted_number(b, converted_b);
+
+        if (a->type != b->type) {
+            if (a->type == json::json_integer && b->type == json::json_double)
+                return integral(b->u.dbl, &integer) && integer == a->u.integer;
+
+            if (a->type == json::json_double && b->type == json::json_integer)
+                return integral(a->u.dbl, &integer) && integer == b->u.integer;
+
+            return false;
+        }
+
+        switch (a->type) {
+            case json::json_integer:
+                return a->u.integer == b->u.integer;
+
+            case json::json_double:
+                return a->u.dbl == b->u.dbl;
+
+            case json::json_string:
+                return a->u.string.length == b->u.string.length
+                       && !std::memcmp(a->u.string.ptr, b->u.string.ptr, a->u.string.length);
+
+            case json::json_boolean:
+                return a->u.boolean == b->u.boolean;
+
+            default:
+                return true;
+        }
+    }
+
+    // Finds member of object `b` with the name of member `index` of object `a`, trying the
+    // same index first as members are usually in the same order
+    const json::value *same_member(const json::value *a, unsigned int index, const json::value *b,
+                                   bool ordered) noexcept {
+        const json::object_entry &entry = a->u.object.values[index];
+
+        if (index < b->u.object.length) {
+            const json::object_entry &same = b->u.object.values[index];
+            if (same.name_length == entry.name_length && !std::memcmp(same.name, entry.name, entry.name_length))
+                return same.value;
+        }
+
+        return ordered ? nullptr : json::find(b, entry.name, entry.name_length);
+    }
+}
+
+bool json::equal(const json::value * a, const json::value * b, bool ordered) noexcept
+{
+    if (!a || !b)
+        return a == b;
+
+    // Walk `a` and follow in `b`, matching object members by name
+    index_stack stack;
+    unsigned int index = 0;
+    bool enter = true;
+
+    for (;;) {
+        if (enter) {
+            if (!same_value(a, b))
+                return false;
+
+            if ((a->type == json_object || a->type == json_array) && a->u.array.length != b->u.array.length)
+                return false;
+
+            index = 0;
+        }
+
+        if ((a->type == json_object || a->type == json_array) && index < a->u.array.length) {
+            stack.push(index);
+
+            if (a->type == json_object) {
+                if (!(b = same_member(a, index, b, ordered)))
+                    return false;
+
+                a = a->u.object.values[index].value;
+            } else {
+                a = a->u.array.values[index];
+                b = b->u.array.values[index];
+            }
+
+            enter = true;
+            continue;
+        }
+
+        if (!stack.depth)
+            return true;
+
+        index = stack.pop(a) + 1;
+        a = a->parent;
+        b = b->parent;
+        enter = false;
+    }
+}
+
+uint64_t json::hash(const json::value * value, bool ordered) noexcept
+{
+    structural_hash hash;
+    hash.reset(ordered);
+
+    for (json::walker walker(value); walker.next(); ) {
+        value = walker.value();
+        const bool container = value->type == json_object || value->type == json_array;
+
+        if (!walker.leaving()) {
+            if (walker.depth())
+                hash.enter(value->parent, walker.index());
+
+            hash.add(value);
+            if (container)
+                continue;
+        }
+
+        if (walker.depth())
+            hash.leave(value->parent, walker.index());
+    }
+
+    return hash.result();
+}
+
+void json::diff(const json::value * a, const json::value * b, json::diff_callback callback, void * user_data) noexcept
+{
+    if (!a || !b) {
+        if (a || b)
+            callback(a ? diff_removed : diff_added, a, b, user_data);
+
+        return;
+    }
+
+    // Walk `a` and follow in `b` as json::equal does, without stopping at differences
+    index_stack stack;
+    unsigned int index = 0;
+
+    for (;;) {
+        if (index == 0 && !same_value(a, b))
+            callback(diff_changed, a, b, user_data);
+
+        if (a->type == json_object && b->type == json_object) {
+            const json::value *member = nullptr;
+            for (; index < a->u.object.length; ++index) {
+                if ((member = same_member(a, index, b, false)))
+                    break;
+
+                callback(diff_removed, a->u.object.values[index].value, nullptr, user_data);
+            }
+
+            if (member) {
+                stack.push(index);
+                a = a->u.object.values[index].value;
+                b = member;
+                index = 0;
+                continue;
+            }
+
+            for (unsigned int i = 0; i < b->u.object.length; ++i) {
+                if (!same_member(b, i, a, false))
+                    callback(diff_added, nullptr, b->u.object.values[i].value, user_data);
+            }
+        } else if (a->type == json_array && b->type == json_array) {
+            const unsigned int common = a->u.array.length < b->u.array.length
+                                        ? a->u.array.length : b->u.array.length;
+
+            if (index < common) {
+                stack.push(index);
+                a = a->u.array.values[index];
+                b = b->u.array.values[index];
+                index = 0;
+                continue;
+            }
+
+            for (unsigned int i = common; i < a->u.array.length; ++i)
+                callback(diff_removed, a->u.array.values[i], nullptr, user_data);
+
+            for (unsigned int i = common; i < b->u.array.length; ++i)
+                callback(diff_added, nullptr, b->u.array.values[i], user_data);
+        }
+
+        if (!stack.depth)
+            return;
+
+        index = stack.pop(a) + 1;
+        a = a->parent;
+        b = b->parent;
+    }
+}
+
+void json::write_pointer(json::writer & out, const json::value * value) noexcept
+{
+    unsigned int depth = 0;
+    for (const json::value *node = value; node && node->parent; node = node->parent)
+        ++depth;
+
+    // from the root down, finding each ancestor again to avoid storing the path
+    for (; depth > 0; --depth) {
+        const json::value *node = value;
+        for (unsigned int i = 1; i < depth; ++i)
+            node = node->parent;
+
+        const json::value *parent = node->parent;
+        out.put('/');
+
+        if (parent->type == json_object) {
+            unsigned int index = 0;
+            while (parent->u.object.values[index].value != node)
+                ++index;
+
+            const json::object_entry &entry = parent->u.object.values[index];
+            for (unsigned int i = 0; i < entry.name_length; ++i) {
+                if (entry.name[i] == '~')
+                    out.put("~0", 2);
+                else if (entry.name[i] == '/')
+                    out.put("~1", 2);
+                else
+                    out.put(entry.name[i]);
+            }
+        } else {
+            unsigned int index = 0;
+            while (parent->u.array.values[index] != node)
+                ++index;
+
+            json::write_unsigned(out, index);
+        }
+    }
+}
+
+namespace {
+    // Reads a character of RFC 6901 reference token, where `~0` stands for `~` and `~1` for `/`,
+    // advancing `*token` past it; returns -1 for `~` followed by anything else
+    int token_char(const char **token, const char *end) noexcept {
+        const char *const ptr = *token;
+        if (*ptr != '~') {
+            ++*token;
+            return (unsigned char) *ptr;
+        }
+
+        if (ptr + 1 == end || (ptr[1] != '0' && ptr[1] != '1'))
+            return -1;
+
+        *token += 2;
+        return ptr[1] == '0' ? '~' : '/';
+    }
+
+    // Compares reference token with a name, never equal if the token is not valid
+    bool token_equals(const char *token, std::size_t token_length, const char *name, std::size_t name_length) noexcept {
+        const char *const end = token + token_length;
+        std::size_t i = 0;
+
+        for (; token < end; ++i) {
+            const int c = token_char(&token, end);
+            if (c < 0 || i == name_length || (unsigned char) name[i] != c)
+                return false;
+        }
+
+        return i == name_length;
+    }
+
+    bool token_index(const char *token, std::size_t length, unsigned int *index) noexcept {
+        if (!length || (length > 1 && token[0] == '0') || length > 9)
+            return false;
+
+        *index = 0;
+        for (std::size_t i = 0; i < length; ++i) {
+            if (!std::isdigit(token[i]))
+                return false;
+
+            *index = *index * 10 + (token[i] - '0');
+        }
+
+        return true;
+    }
+
+    // Index of object member named by the token, ~0u if not found
+    unsigned int token_member(const json::value *object, const char *token, std::size_t length) noexcept {
+        for (unsigned int i = 0; i < object->u.object.length; ++i) {
+            const json::object_entry &entry = object->u.object.values[i];
+            if (token_equals(token, length, entry.name, entry.name_length))
+                return i;
+        }
+
+        return ~0u;
+    }
+
+    // Finds container referenced by all but the last token of a JSON pointer, and that token
+    const json::value *pointer_parent(const json::value *root, const char *path, std::size_t length,
+                                      const char **token, std::size_t *token_length) noexcept {
+        if (!length || path[0] != '/')
+            return nullptr;
+
+        std::size_t last = length;
+        while (path[--last] != '/');
+
+        *token = path + last + 1;
+        *token_length = length - last - 1;
+        return json::pointer(root, path, last);
+    }
+
+    // Finds container and index of existing element referenced by non-empty JSON pointer
+    const json::value *pointer_element(const json::value *root, const char *path, std::size_t length,
+                                       unsigned int *index) noexcept {
+        const char *token;
+        std::size_t token_length;
+        const json::value *parent = pointer_parent(root, path, length, &token, &token_length);
+
+        if (parent && parent->type == json::json_object)
+            *index = token_member(parent, token, token_length);
+        else if (!parent || parent->type != json::json_array || !token_index(token, token_length, index))
+            return nullptr;
+
+        return *index < parent->u.array.length ? parent : nullptr;
+    }
+}
+
+const json::value * json::pointer(const json::value * root, const char * path, size_t length) noexcept
+{
+    const char *const end = path + length;
+    if (length && *path != '/')
+        return nullptr;
+
+    const json::value *value = root;
+    while (value && path < end) {
+        const char *token = ++path;
+        while (path < end && *path != '/')
+            ++path;
+
+        const std::size_t token_length = path - token;
+        unsigned int index;
+
+        if (value->type == json_object) {
+            index = token_member(value, token, token_length);
+            value = index < value->u.object.length ? value->u.object.values[index].value : nullptr;
+        } else if (value->type == json_array && token_index(token, token_length, &index)
+                   && index < value->u.array.length) {
+            value = value->u.array.values[index];
+        } else
+            value = nullptr;
+    }
+
+    return value;
+}
+
+namespace {
+    // Skips whitespace, and comments if allowed; returns nullptr if a block comment is not closed
+    const char *skip_space(const char *ptr, const char *end, bool comments) noexcept {
+        while (ptr < end) {
+            if (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n') {
+                ++ptr;
+            } else if (comments && *ptr == '/' && ptr + 1 < end && ptr[1] == '/') {
+                for (ptr += 2; ptr < end && *ptr != '\r' && *ptr != '\n'; ++ptr);
+            } else if (comments && *ptr == '/' && ptr + 1 < end && ptr[1] == '*') {
+                for (ptr += 2; ptr + 1 < end && !(ptr[0] == '*' && ptr[1] == '/'); ++ptr);
+                if (ptr + 1 >= end)
+                    return nullptr;
+
+                ptr += 2;
+            } else
+                break;
+        }
+
+        return ptr;
+    }
+
+    // Finds how many objects of the patch can be open at once (ignoring objects inside
+    // arrays, which are not merged), and the largest number of their members
+    void patch_extent(const json::value *patch, unsigned int *depth, std::size_t *members) noexcept {
+        std::size_t sum = 0;
+
+        *depth = 0;
+        *members = 0;
+
+        for (json::walker walker(patch); walker.next(); ) {
+            const json::value *value = walker.value();
+            if (value->type != json::json_object) {
+                if (value->type == json::json_array)
+                    walker.skip();
+
+                continue;
+            }
+
+            if (walker.leaving()) {
+                sum -= value->u.object.length;
+                continue;
+            }
+
+            sum += value->u.object.length;
+
+            if (*depth < walker.depth() + 1)
+                *depth = walker.depth() + 1;
+            if (*members < sum)
+                *members = sum;
+        }
+    }
+
+    // Object of the input being merged with an object of the patch
+    struct merge_frame {
+        const json::value *patch;
+        unsigned char *seen;  // for each member of the patch, whether it was found in input
+        unsigned int written;
+    };
+}
+
+bool json::merge_patch(const json::settings & settings_in,
+                       const char * json,
+                       size_t length,
+                       const json::value * patch,
+                       json::writer & out,
+                       char * error_buf) noexcept
+{
+    json::parse_error error = {};
+    const char *const input = json;
+    const std::size_t input_length = length;
+
+    json::settings settings = settings_in;
+    settings.json5 = false;  // text is skipped over as standard JSON
+    default_allocator(settings);
+    skip_bom(json, length);
+
+    const char *const end = json + length;
+    const bool comments = settings.allow_comments;
+    const char *ptr = skip_space(json, end, comments);
+
+    merge_frame *frames = nullptr;
+    unsigned int depth = 0;
+
+    enum { state_open, state_next } state = state_open;  // state_open also follows a comma, as in parse
+
+    if (!patch || patch->type != json_object || !ptr || ptr == end || *ptr != '{') {
+        // nothing of the input remains
+        if (!json::scan(settings, json, end, nullptr, nullptr))
+            goto e_syntax;
+
+        write_tree(out, patch, patch && patch->type == json_object);
+        return true;
+    }
+
+    {
+        unsigned int max_depth;
+        std::size_t max_members;
+        patch_extent(patch, &max_depth, &max_members);
+
+        frames = (merge_frame *) settings.mem_alloc(max_depth * sizeof(merge_frame) + max_members,
+                                                    true, settings.user_data);
+        if (!frames)
+            goto e_alloc_failure;
+
+        frames[depth++] = {patch, (unsigned char *) (frames + max_depth), 0};
+        out.put('{');
+        ++ptr;
+    }
+
+    for (;;) {
+        merge_frame &frame = frames[depth - 1];
+        const unsigned int patch_length = frame.patch->u.object.length;
+
+        if (!(ptr = skip_space(ptr, end, comments)) || ptr == end)
+            goto e_syntax;
+
+        if (state == state_next) {
+            if (*ptr == ',') {
+                ++ptr;
+                state = state_open;
+                continue;
+            }
+
+            if (*ptr != '}')
+                goto e_syntax;
+        } else if (*ptr != '}') {
+            // member of the input object
+            const char *const key = ptr;
+            const char *key_end;
+            if (*ptr != '"' || !json::scan(settings, key, end, &key_end, nullptr))
+                goto e_syntax;
+
+            if (!(ptr = skip_space(key_end, end, comments)) || ptr == end || *ptr != ':')
+                goto e_syntax;
+
+            if (!(ptr = skip_space(ptr + 1, end, comments)) || ptr == end)
+                goto e_syntax;
+
+            const char *name = key + 1;
+            std::size_t name_length = key_end - key - 2;
+            const json::value *decoded = nullptr;
+
+            if (std::memchr(name, '\\', name_length)) {
+                if (!(decoded = json::parse(settings, key, key_end - key, error)))
+                    goto e_alloc_failure;
+
+                name = decoded->u.string.ptr;
+                name_length = decoded->u.string.length;
+            }
+
+            const json::value *member = nullptr;
+            for (unsigned int i = 0; i < patch_length; ++i) {
+                const json::object_entry &entry = frame.patch->u.object.values[i];
+                if (entry.name_length == name_length && !std::memcmp(entry.name, name, name_length)) {
+                    frame.seen[i] = 1;
+                    member = entry.value;
+                    break;
+                }
+            }
+
+            if (decoded)
+                json::value_free(settings, decoded);
+
+            if (member && member->type == json_object && *ptr == '{') {
+                if (frame.written++)
+                    out.put(',');
+
+                out.put(key, key_end - key);
+                out.put(":{", 2);
+
+                unsigned char *const seen = frame.seen + patch_length;
+                std::memset(seen, 0, member->u.object.length);
+                frames[depth++] = {member, seen, 0};
+
+                ++ptr;
+                state = state_open;
+                continue;
+            }
+
+            const char *value_end;
+            if (!json::scan(settings, ptr, end, &value_end, nullptr))
+                goto e_syntax;
+
+            if (!member || member->type != json_null) {
+                if (frame.written++)
+                    out.put(',');
+
+                out.put(key, key_end - key);
+                out.put(':');
+
+                if (member)
+                    write_tree(out, member, member->type == json_object);
+                else
+                    out.put(ptr, value_end - ptr);
+            }
+
+            ptr = value_end;
+            state = state_next;
+            continue;
+        }
+
+        // end of the input object, add members of the patch which were not in it
+        for (unsigned int i = 0; i < patch_length; ++i) {
+            const json::object_entry &entry = frame.patch->u.object.values[i];
+            if (frame.seen[i] || entry.value->type == json_null)
+                continue;
+
+            if (frame.written++)
+                out.put(',');
+
+            json::write_string(out, entry.name, entry.name_length);
+            out.put(':');
+            write_tree(out, entry.value, true);
+        }
+
+        out.put('}');
+        ++ptr;
+        state = state_next;
+
+        if (!--depth)
+            break;
+    }
+
+    if (skip_space(ptr, end, comments) != end)
+        goto e_syntax;
+
+    settings.mem_free(frames, settings.user_data);
+    return true;
+
+e_syntax:
+    // report the error as json::validate would, with position in the whole input
+    if (json::validate(settings, input, input_length, error)) {
+        error.code = json::error_unexpected_value;
+        error.character = ptr < end ? *ptr : 0;
+        error.offset = ptr - input;
+        locate(error, input);
+    }
+
+    goto e_failed;
+
+e_alloc_failure:
+    error.code = json::error_memory;
+    error.offset = ptr - input;
+    locate(error, input);
+
+e_failed:
+    if (frames)
+        settings.mem_free(frames, settings.user_data);
+
+    if (error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return false;
+}
+
+namespace {
+    // Decodes string contents [ptr, end) already checked by json::scan, returns decoded length
+    std::size_t decode_string(const char *ptr, const char *end, char *out) noexcept {
+        char *const start = out;
+
+        for (;;) {
+            const char *const plain = skip_string(ptr, end);
+            std::memcpy(out, ptr, plain - ptr);
+            out += plain - ptr;
+
+            if ((ptr = plain) == end)
+                return out - start;
+
+            if (*ptr != '\\') {
+                *out++ = *ptr++;  // control character
+                continue;
+            }
+
+            uint32_t uchar;
+            switch (*++ptr) {
+                case 'b': *out++ = '\b'; ++ptr; continue;
+                case 'f': *out++ = '\f'; ++ptr; continue;
+                case 'n': *out++ = '\n'; ++ptr; continue;
+                case 'r': *out++ = '\r'; ++ptr; continue;
+                case 't': *out++ = '\t'; ++ptr; continue;
+                case 'u':
+                    uchar = (hex_value(ptr[1]) << 12) | (hex_value(ptr[2]) << 8)
+                            | (hex_value(ptr[3]) << 4) | hex_value(ptr[4]);
+                    ptr += 5;
+
+                    if ((uchar & 0xF800) == 0xD800) {
+                        const uint32_t uchar2 = (hex_value(ptr[2]) << 12) | (hex_value(ptr[3]) << 8)
+                                                | (hex_value(ptr[4]) << 4) | hex_value(ptr[5]);
+                        uchar = 0x010000 | ((uchar & 0x3FF) << 10) | (uchar2 & 0x3FF);
+                        ptr += 6;
+                    }
+
+                    if (uchar <= 0x7F) {
+                        *out++ = (char) uchar;
+                    } else if (uchar <= 0x7FF) {
+                        *out++ = 0xC0 | (uchar >> 6);
+                        *out++ = 0x80 | (uchar & 0x3F);
+                    } else if (uchar <= 0xFFFF) {
+                        *out++ = 0xE0 | (uchar >> 12);
+                        *out++ = 0x80 | ((uchar >> 6) & 0x3F);
+                        *out++ = 0x80 | (uchar & 0x3F);
+                    } else {
+                        *out++ = 0xF0 | (uchar >> 18);
+                        *out++ = 0x80 | ((uchar >> 12) & 0x3F);
+                        *out++ = 0x80 | ((uchar >> 6) & 0x3F);
+                        *out++ = 0x80 | (uchar & 0x3F);
+                    }
+                    continue;
+                default:
+                    *out++ = *ptr++;
+                    continue;
+            }
+        }
+    }
+
+    // Returns pointer to the first of `"`, `/` or a bracket in [ptr, end)
+    const char *skip_plain(const char *ptr, const char *end) noexcept {
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i slash = _mm_set1_epi8('/');
+        const __m128i lower = _mm_set1_epi8(0x20);  // maps `[` to `{` and `]` to `}`
+        const __m128i open = _mm_set1_epi8('{');
+        const __m128i close = _mm_set1_epi8('}');
+
+        for (; end - ptr >= 16; ptr += 16) {
+            const __m128i chunk = _mm_loadu_si128((const __m128i *) ptr);
+            const __m128i folded = _mm_or_si128(chunk, lower);
+            const __m128i special = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, slash)),
+                    _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)));
+
+            const int mask = _mm_movemask_epi8(special);
+            if (mask)
+                return ptr + __builtin_ctz(mask);
+        }
+#endif
+        while (ptr < end && *ptr != '"' && *ptr != '/' && (*ptr | 0x20) != '{' && (*ptr | 0x20) != '}')
+            ++ptr;
+
+        return ptr;
+    }
+
+    // Returns end of the value at ptr, in input already checked by json::scan
+    const char *skip_value(const char *ptr, const char *end, bool comments) noexcept {
+        if (*ptr == '"') {
+            for (++ptr; *(ptr = skip_string(ptr, end)) != '"'; )
+                ptr += *ptr == '\\' ? 2 : 1;
+
+            return ptr + 1;
+        }
+
+        if (*ptr != '{' && *ptr != '[') {
+            while (ptr < end && *ptr != ',' && *ptr != ']' && *ptr != '}' && *ptr != '/'
+                   && *ptr != ' ' && *ptr != '\t' && *ptr != '\r' && *ptr != '\n') {
+                ++ptr;
+            }
+
+            return ptr;
+        }
+
+        for (unsigned int depth = 1; ++ptr, depth; ) {
+            switch (*(ptr = skip_plain(ptr, end))) {
+                case '"':
+                    for (++ptr; *(ptr = skip_string(ptr, end)) != '"'; )
+                        ptr += *ptr == '\\' ? 2 : 1;
+                    break;
+                case '/':
+                    ptr = skip_space(ptr, end, comments) - 1;
+                    break;
+                case '{': case '[':
+                    ++depth;
+                    break;
+                default:
+                    --depth;
+            }
+        }
+
+        return ptr;
+    }
+
+    struct path_token {
+        const char *ptr;
+        std::size_t length;
+    };
+
+    struct column_state {
+        const path_token *tokens;
+        unsigned int length;   // number of tokens
+        unsigned int matched;  // number of tokens matched by path to the current value
+        std::size_t chars;     // length of strings, an upper bound in the first pass
+        std::size_t valid;
+        std::size_t row;       // one past the row in which the path was already followed
+    };
+}
+
+bool json::extract(const json::settings & settings_in,
+                   const char * json,
+                   size_t length,
+                   json::column * columns,
+                   size_t count,
+                   size_t * rows_out,
+                   json::parse_error & error) noexcept
+{
+    error = json::parse_error();
+    const char *const input = json;
+    const std::size_t input_length = length;
+
+    json::settings settings = settings_in;
+    settings.json5 = false;  // text is skipped over as standard JSON
+    default_allocator(settings);
+    skip_bom(json, length);
+
+    const char *const end = json + length;
+    const bool comments = settings.allow_comments;
+    const char *ptr = json;
+
+    column_state *states = nullptr;
+    char *name_buffer = nullptr;
+    std::size_t name_capacity = 0;
+    std::size_t rows = 0;
+    std::size_t tokens = 0;
+    std::size_t path_chars = 0;
+    bool strings = false;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        columns[i].integers = nullptr;
+        columns[i].chars = nullptr;
+        columns[i].valid = nullptr;
+        columns[i].null_count = 0;
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+        const json::column &column = columns[i];
+        if (column.path_length && column.path[0] != '/') {
+            error.code = json::error_invalid_column_path;
+            goto e_failed;
+        }
+
+        if (column.type > json::column_string) {
+            error.code = json::error_invalid_column_type;
+            goto e_failed;
+        }
+
+        for (std::size_t j = 0; j < column.path_length; ++j)
+            tokens += column.path[j] == '/';
+
+        path_chars += column.path_length;
+        strings |= column.type == json::column_string;
+    }
+
+    // checked once, so that both passes can skip values quickly
+    if (!json::validate(settings, input, input_length, error))
+        goto e_failed;
+
+    if ((ptr = skip_space(json, end, comments)) == end || *ptr != '[') {
+        error.code = json::error_expected_records;
+        error.character = ptr < end ? *ptr : 0;
+        error.offset = ptr - input;
+        locate(error, input);
+        goto e_failed;
+    }
+
+    states = (column_state *) settings.mem_alloc(count * sizeof(column_state) + tokens * sizeof(path_token)
+                                                 + path_chars, true, settings.user_data);
+    if (!states)
+        goto e_alloc_failure;
+
+    {
+        // split paths into tokens, with `~1` and `~0` replaced by `/` and `~`
+        path_token *token = (path_token *) (states + count);
+        char *chars = (char *) (token + tokens);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            const char *path = columns[i].path;
+            const char *const path_end = path + columns[i].path_length;
+            states[i].tokens = token;
+
+            while (path < path_end) {
+                token->ptr = chars;
+                for (++path; path < path_end && *path != '/'; ) {
+                    const int c = token_char(&path, path_end);
+                    if (c < 0) {
+                        error.code = json::error_invalid_column_path;
+                        goto e_failed;
+                    }
+
+                    *chars++ = c;
+                }
+
+                token->length = chars - token->ptr;
+                ++token;
+                ++states[i].length;
+            }
+        }
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        const bool fill = pass;
+        std::size_t row = 0;
+        unsigned int depth = 0;  // number of objects entered within the current record
+
+        ptr = skip_space(json, end, comments) + 1;
+
+        for (;;) {
+            ptr = skip_space(ptr, end, comments);
+
+            if (*ptr == (depth ? '}' : ']')) {
+                ++ptr;
+                if (!depth)
+                    break;
+
+                --depth;
+            } else if (*ptr == ',') {
+                ++ptr;
+                continue;
+            } else {
+                if (depth) {
+                    // member of an object on the path of some column
+                    const char *const key = ptr;
+                    const char *const key_end = skip_value(key, end, false);
+                    ptr = skip_space(skip_space(key_end, end, comments) + 1, end, comments);
+
+                    const char *name = key + 1;
+                    std::size_t name_length = key_end - key - 2;
+
+                    if (std::memchr(name, '\\', name_length)) {
+                        if (name_capacity < name_length) {
+                            if (name_buffer)
+                                settings.mem_free(name_buffer, settings.user_data);
+
+                            if (!(name_buffer = (char *) settings.mem_alloc(name_length, false, settings.user_data)))
+                                goto e_alloc_failure;
+
+                            name_capacity = name_length;
+                        }
+
+                        name_length = decode_string(name, name + name_length, name_buffer);
+                        name = name_buffer;
+                    }
+
+                    for (std::size_t i = 0; i < count; ++i) {
+                        column_state &state = states[i];
+                        if (state.matched == depth - 1 && state.length >= depth && state.row != row + 1) {
+                            const path_token &token = state.tokens[depth - 1];
+                            if (token.length == name_length && !std::memcmp(token.ptr, name, name_length))
+                                state.matched = depth;
+                        }
+                    }
+                }
+
+                // value at `depth` tokens of the path, either taken by columns or entered;
+                // records are only counted in the first pass, unless strings need measuring
+                bool enter = false;
+                bool take = false;
+                for (std::size_t i = 0; (fill || strings) && i < count; ++i) {
+                    if (states[i].matched == depth) {
+                        take |= states[i].length == depth;
+                        enter |= states[i].length > depth;
+                    }
+                }
+
+                if (enter && *ptr == '{') {
+                    ++depth;
+                    ++ptr;
+                    continue;
+                }
+
+                const char *const value_end = skip_value(ptr, end, comments);
+
+                for (std::size_t i = 0; take && i < count; ++i) {
+                    column_state &state = states[i];
+                    if (state.matched != depth || state.length != depth)
+                        continue;
+
+                    json::column &column = columns[i];
+                    if (!fill) {
+                        if (column.type == json::column_string && *ptr == '"')
+                            state.chars += value_end - ptr - 2;
+                        continue;
+                    }
+
+                    bool valid = false;
+                    switch (column.type) {
+                        case json::column_integer:
+                            if (*ptr == '-' || std::isdigit(*ptr)) {
+                                const auto result = std::from_chars(ptr, value_end, column.integers[row]);
+                                valid = result.ec == std::errc() && result.ptr == value_end;
+                                if (!valid)
+                                    column.integers[row] = 0;
+                            }
+                            break;
+                        case json::column_double:
+                            if (*ptr == '-' || std::isdigit(*ptr)) {
+                                const auto result = std::from_chars(ptr, value_end, column.doubles[row]);
+                                valid = result.ec == std::errc();
+                                if (!valid)
+                                    column.doubles[row] = 0;
+                            }
+                            break;
+                        case json::column_boolean:
+                            if (*ptr == 't' || *ptr == 'f') {
+                                column.booleans[row] = *ptr == 't';
+                                valid = true;
+                            }
+                            break;
+                        case json::column_string:
+                            if (*ptr == '"') {
+                                state.chars += decode_string(ptr + 1, value_end - 1, column.chars + state.chars);
+                                valid = true;
+                            }
+                            break;
+                    }
+
+                    if (valid) {
+                        column.valid[row >> 3] |= 1 << (row & 7);
+                        ++state.valid;
+                    }
+                }
+
+                ptr = value_end;
+            }
+
+            // end of value at `depth` tokens of the path
+            if (depth) {
+                for (std::size_t i = 0; i < count; ++i) {
+                    if (states[i].matched == depth) {
+                        --states[i].matched;
+                        states[i].row = row + 1;
+                    }
+                }
+
+                continue;
+            }
+
+            if (fill) {
+                for (std::size_t i = 0; i < count; ++i) {
+                    if (columns[i].type == json::column_string)
+                        columns[i].offsets[row + 1] = states[i].chars;
+                }
+            } else if (settings.max_elements && row >= settings.max_elements) {
+                error.code = json::error_too_many_elements;
+                error.offset = ptr - input;
+                locate(error, input);
+                goto e_failed;
+            }
+
+            ++row;
+        }
+
+        if (fill)
+            break;
+
+        rows = row;
+        for (std::size_t i = 0; i < count; ++i) {
+            json::column &column = columns[i];
+            std::size_t size;
+
+            switch (column.type) {
+                case json::column_integer: size = rows * sizeof(int64_t); break;
+                case json::column_double: size = rows * sizeof(double); break;
+                case json::column_boolean: size = rows * sizeof(bool); break;
+                default:
+                    size = (rows + 1) * sizeof(std::size_t);
+                    if (!(column.chars = (char *) settings.mem_alloc(states[i].chars ? states[i].chars : 1,
+                                                                     false, settings.user_data))) {
+                        goto e_alloc_failure;
+                    }
+            }
+
+            if (!(column.integers = (int64_t *) settings.mem_alloc(size ? size : 1, true, settings.user_data))
+                || !(column.valid = (uint8_t *) settings.mem_alloc((rows + 7) / 8 + 1, true, settings.user_data))) {
+                goto e_alloc_failure;
+            }
+
+            states[i].chars = 0;
+            states[i].row = 0;
+        }
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
+        columns[i].null_count = rows - states[i].valid;
+
+    if (name_buffer)
+        settings.mem_free(name_buffer, settings.user_data);
+
+    settings.mem_free(states, settings.user_data);
+    *rows_out = rows;
+    return true;
+
+e_alloc_failure:
+    error.code = json::error_memory;
+    error.offset = ptr - input;
+    locate(error, input);
+
+e_failed:
+    if (name_buffer)
+        settings.mem_free(name_buffer, settings.user_data);
+
+    if (states)
+        settings.mem_free(states, settings.user_data);
+
+    json::column_free(settings, columns, count);
+    return false;
+}
+
+bool json::extract(const json::settings & settings,
+                   const char * json,
+                   size_t length,
+                   json::column * columns,
+                   size_t count,
+                   size_t * rows,
+                   char * error_buf) noexcept
+{
+    json::parse_error error;
+    const bool result = json::extract(settings, json, length, columns, count, rows, error);
+
+    if (!result && error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return result;
+}
+
+void json::column_free(const json::settings & settings, json::column * columns, size_t count) noexcept
+{
+    void (*const mem_free)(void *, void *) = settings.mem_free ? settings.mem_free : default_free;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        json::column &column = columns[i];
+        if (column.integers)
+            mem_free(column.integers, settings.user_data);
+
+        if (column.chars)
+            mem_free(column.chars, settings.user_data);
+
+        if (column.valid)
+            mem_free(column.valid, settings.user_data);
+
+        column.integers = nullptr;
+        column.chars = nullptr;
+        column.valid = nullptr;
+    }
+}
+
+// Arena chunk, followed by its data
+struct json::document::chunk {
+    chunk *next;
+    std::size_t size;
+    std::size_t used;
+};
+
+namespace {
+    constexpr std::size_t arena_align = alignof(std::max_align_t);
+    constexpr std::size_t chunk_header = (sizeof(json::document::chunk) + arena_align - 1) & ~(arena_align - 1);
+    constexpr std::size_t chunk_min = 1024;
+    constexpr std::size_t chunk_max = 1024 * 1024;
+}
+
+json::document::document(const json::settings & settings) noexcept
+        : settings(settings), chunks(nullptr), root_value(nullptr)
+{
+    default_allocator(this->settings);
+}
+
+json::document::document(json::document && other) noexcept
+        : settings(other.settings), chunks(other.chunks), root_value(other.root_value)
+{
+    other.chunks = nullptr;
+    other.root_value = nullptr;
+}
+
+json::document & json::document::operator=(json::document && other) noexcept
+{
+    if (this != &other) {
+        clear();
+        settings = other.settings;
+        chunks = other.chunks;
+        root_value = other.root_value;
+        other.chunks = nullptr;
+        other.root_value = nullptr;
+    }
+
+    return *this;
+}
+
+json::document::~document()
+{
+    clear();
+}
+
+void json::document::clear() noexcept
+{
+    rewind(nullptr, 0);
+    root_value = nullptr;
+}
+
+void json::document::rewind(chunk * mark, std::size_t used) noexcept
+{
+    while (chunks != mark) {
+        chunk *next = chunks->next;
+        settings.mem_free(chunks, settings.user_data);
+        chunks = next;
+    }
+
+    if (chunks)
+        chunks->used = used;
+}
+
+void * json::document::allocate(std::size_t size) noexcept
+{
+    size = (size + arena_align - 1) & ~(arena_align - 1);
+
+    if (!chunks || chunks->size - chunks->used < size) {
+        std::size_t chunk_size = chunks ? chunks->size * 2 : chunk_min;
+        if (chunk_size > chunk_max)
+            chunk_size = chunk_max;
+
+        if (chunk_size < size)
+            chunk_size = size;
+
+        chunk *next = (chunk *) settings.mem_alloc(chunk_header + chunk_size, false, settings.user_data);
+        if (!next)
+            return nullptr;
+
+        next->next = chunks;
+        next->size = chunk_size;
+        next->used = 0;
+        chunks = next;
+    }
+
+    void *result = ((char *) chunks) + chunk_header + chunks->used;
+    chunks->used += size;
+    return result;
+}
+
+void * json::document::arena_alloc(std::size_t size, int zero, void * user_data) noexcept
+{
+    void *result = static_cast<json::document *>(user_data)->allocate(size);
+    if (result && zero)
+        std::memset(result, 0, size);
+
+    return result;
+}
+
+void json::document::arena_free(void *, void *) noexcept
+{
+    // released together with the document
+}
+
+bool json::document::parse(const char * json, size_t length, json::parse_error & error) noexcept
+{
+    json::settings arena_settings = settings;
+    arena_settings.mem_alloc = arena_alloc;
+    arena_settings.mem_free = arena_free;
+    arena_settings.user_data = this;
+
+    chunk *const mark = chunks;
+    const std::size_t used = chunks ? chunks->used : 0;
+
+    const json::value *value = json::parse(arena_settings, json, length, error);
+    if (!value) {
+        rewind(mark, used);
+        return false;
+    }
+
+    root_value = value;
+    return true;
+}
+
+bool json::document::parse(const char * json, size_t length, char * error_buf) noexcept
+{
+    json::parse_error error;
+    if (parse(json, length, error))
+        return true;
+
+    if (error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return false;
+}
+
+bool json::document::set_root(const json::value * value) noexcept
+{
+    if (value && value->parent)
+        return false;
+
+    root_value = value;
+    return true;
+}
+
+namespace {
+    json_value *mutable_value(const json::value *value) noexcept {
+        return reinterpret_cast<json_value *>(const_cast<json::value *>(value));
+    }
+
+    std::size_t table_entry_size(const json_value *container) noexcept {
+        return container->type == json::json_object ? sizeof(object_entry) : sizeof(json_value *);
+    }
+}
+
+json::value * json::document::make(json::type type) noexcept
+{
+    json_value *value = (json_value *) allocate(sizeof(json_value) + settings.value_extra);
+    if (!value)
+        return nullptr;
+
+    std::memset((void *) value, 0, sizeof(json_value) + settings.value_extra);
+    value->type = type;
+    return reinterpret_cast<json::value *>(value);
+}
+
+char * json::document::copy_string(const char * str, size_t length) noexcept
+{
+    if (length > std::numeric_limits<unsigned int>::max() - 8)
+        return nullptr;
+
+    char *result = (char *) allocate(length + 1);
+    if (result) {
+        std::memcpy(result, str, length);
+        result[length] = 0;
+    }
+
+    return result;
+}
+
+const json::value * json::document::make_null() noexcept
+{
+    return make(json_null);
+}
+
+const json::value * json::document::make_boolean(bool boolean) noexcept
+{
+    json::value *value = make(json_boolean);
+    if (value)
+        value->u.boolean = boolean;
+
+    return value;
+}
+
+const json::value * json::document::make_integer(int64_t integer) noexcept
+{
+    json::value *value = make(json_integer);
+    if (value)
+        value->u.integer = integer;
+
+    return value;
+}
+
+const json::value * json::document::make_double(double dbl) noexcept
+{
+    json::value *value = make(json_double);
+    if (value)
+        value->u.dbl = dbl;
+
+    return value;
+}
+
+const json::value * json::document::make_string(const char * str, size_t length) noexcept
+{
+    json::value *value = make(json_string);
+    if (!value || !(value->u.string.ptr = copy_string(str, length)))
+        return nullptr;
+
+    value->u.string.length = length;
+    return value;
+}
+
+const json::value * json::document::make_array() noexcept
+{
+    return make(json_array);
+}
+
+const json::value * json::document::make_object() noexcept
+{
+    return make(json_object);
+}
+
+const json::value * json::document::copy(const json::value * source) noexcept
+{
+    if (!source)
+        return nullptr;
+
+    chunk *const mark = chunks;
+    const std::size_t used = chunks ? chunks->used : 0;
+
+    // Walk the source and the copy in step, without recursion. Length of a container in
+    // the copy is also the index of the next element to copy from the source
+    const json_value *from = reinterpret_cast<const json_value *>(source);
+    json_value *parent = nullptr;
+    json_value *result = nullptr;
+    json_value *to;
+
+    for (;;) {
+        if (!(to = mutable_value(make(from->type))))
+            goto e_failed;
+
+        to->parent = parent;
+        to->u = from->u;
+#ifdef JSON_TRACK_SPAN
+        to->offset = from->offset;
+        to->length = from->length;
+#endif
+
+        switch (from->type) {
+            case json_string:
+                if (!(to->u.string.ptr = copy_string(from->u.string.ptr, from->u.string.length)))
+                    goto e_failed;
+                break;
+
+            case json_number:
+                if (!(to->u.number.ptr = copy_string(from->u.number.ptr, from->u.number.length)))
+                    goto e_failed;
+                break;
+
+            case json_object:
+            case json_array:
+                to->u.array.values = nullptr;
+                if (from->u.array.length) {
+                    if (!(*(void **) &to->u.array.values = allocate(from->u.array.length * table_entry_size(to))))
+                        goto e_failed;
+                }
+
+                to->u.array.length = 0;
+                break;
+
+            default:
+                break;
+        }
+
+        if (!parent)
+            result = to;
+        else if (parent->type == json_object) {
+            ::object_entry &entry = parent->u.object.values[parent->u.object.length];
+            const ::object_entry &name = from->parent->u.object.values[parent->u.object.length];
+
+            if (!(entry.name = copy_string(name.name, name.name_length)))
+                goto e_failed;
+
+            entry.name_length = name.name_length;
+            entry.value = to;
+            ++parent->u.object.length;
+        } else
+            parent->u.array.values[parent->u.array.length++] = to;
+
+        // descend into the next element not yet copied, or go up until there is one
+        while (!((to->type == json_object || to->type == json_array)
+                 && to->u.array.length < from->u.array.length)) {
+            if (!to->parent)
+                return reinterpret_cast<json::value *>(result);
+
+            to = to->parent;
+            from = from->parent;
+        }
+
+        parent = to;
+        from = from->type == json_object
+               ? from->u.object.values[to->u.object.length].value
+               : from->u.array.values[to->u.array.length];
+    }
+
+    e_failed:
+    rewind(mark, used);
+    return nullptr;
+}
+
+void json::document::set_null(const json::value * target) noexcept
+{
+    json_value *value = mutable_value(target);
+    value->type = json_null;
+    value->_reserved.capacity = 0;
+}
+
+void json::document::set_boolean(const json::value * target, bool boolean) noexcept
+{
+    json_value *value = mutable_value(target);
+    value->type = json_boolean;
+    value->u.boolean = boolean;
+    value->_reserved.capacity = 0;
+}
+
+void json::document::set_integer(const json::value * target, int64_t integer) noexcept
+{
+    json_value *value = mutable_value(target);
+    value->type = json_integer;
+    value->u.integer = integer;
+    value->_reserved.capacity = 0;
+}
+
+void json::document::set_double(const json::value * target, double dbl) noexcept
+{
+    json_value *value = mutable_value(target);
+    value->type = json_double;
+    value->u.dbl = dbl;
+    value->_reserved.capacity = 0;
+}
+
+bool json::document::set_string(const json::value * target, const char * str, size_t length) noexcept
+{
+    char *ptr = copy_string(str, length);
+    if (!ptr)
+        return false;
+
+    json_value *value = mutable_value(target);
+    value->type = json_string;
+    value->u.string.ptr = ptr;
+    value->u.string.length = length;
+    value->_reserved.capacity = 0;
+    return true;
+}
+
+bool json::document::attachable(const json::value * container, const json::value * element) const noexcept
+{
+    if (!container || !element || element->parent || element == root_value)
+        return false;
+
+    // refuse to create a cycle
+    for (const json::value *value = container; value; value = value->parent) {
+        if (value == element)
+            return false;
+    }
+
+    return true;
+}
+
+bool json::document::reserve(const json::value * target) noexcept
+{
+    json_value *container = mutable_value(target);
+    const std::size_t length = container->u.array.length;
+    if (length < container->_reserved.capacity)
+        return true;
+
+    if (length >= std::numeric_limits<unsigned int>::max() / 2)
+        return false;
+
+    const std::size_t capacity = length < 2 ? 4 : length * 2;
+    const std::size_t entry_size = table_entry_size(container);
+    void *values = allocate(capacity * entry_size);
+    if (!values)
+        return false;
+
+    if (length)
+        std::memcpy(values, container->u.array.values, length * entry_size);
+
+    *(void **) &container->u.array.values = values;
+    container->_reserved.capacity = capacity;
+    return true;
+}
+
+bool json::document::append(const json::value * array, const json::value * element) noexcept
+{
+    return array && json::document::insert(array, array->u.array.length, element);
+}
+
+bool json::document::insert(const json::value * array, unsigned int index, const json::value * element) noexcept
+{
+    if (!attachable(array, element) || array->type != json_array
+        || index > array->u.array.length || !reserve(array)) {
+        return false;
+    }
+
+    json_value *container = mutable_value(array);
+    json_value **values = container->u.array.values;
+    std::memmove(values + index + 1, values + index, (container->u.array.length - index) * sizeof(*values));
+
+    values[index] = mutable_value(element);
+    values[index]->parent = container;
+    ++container->u.array.length;
+    return true;
+}
+
+bool json::document::replace(const json::value * target, unsigned int index, const json::value * element) noexcept
+{
+    if (!attachable(target, element) || (target->type != json_array && target->type != json_object)
+        || index >= target->u.array.length) {
+        return false;
+    }
+
+    json_value *container = mutable_value(target);
+    json_value **slot = container->type == json_object
+                        ? &container->u.object.values[index].value
+                        : &container->u.array.values[index];
+
+    (*slot)->parent = nullptr;
+    *slot = mutable_value(element);
+    (*slot)->parent = container;
+    return true;
+}
+
+bool json::document::remove(const json::value * target, unsigned int index) noexcept
+{
+    if (!target || (target->type != json_array && target->type != json_object)
+        || index >= target->u.array.length) {
+        return false;
+    }
+
+    json_value *container = mutable_value(target);
+    const unsigned int tail = container->u.array.length - index - 1;
+
+    if (container->type == json_object) {
+        ::object_entry *values = container->u.object.values;
+        values[index].value->parent = nullptr;
+        std::memmove(values + index, values + index + 1, tail * sizeof(*values));
+    } else {
+        json_value **values = container->u.array.values;
+        values[index]->parent = nullptr;
+        std::memmove(values + index, values + index + 1, tail * sizeof(*values));
+    }
+
+    --container->u.array.length;
+    return true;
+}
+
+bool json::document::set(const json::value * object, const char * name, size_t length,
+                         const json::value * element) noexcept
+{
+    if (!object || object->type != json_object)
+        return false;
+
+    for (unsigned int i = 0; i < object->u.object.length; ++i) {
+        const json::object_entry &entry = object->u.object.values[i];
+        if (entry.name_length == length && !std::memcmp(entry.name, name, length))
+            return replace(object, i, element);
+    }
+
+    char *copy = copy_string(name, length);
+    return copy && add(object, copy, length, element);
+}
+
+// Adds member at the end of the object, taking name already allocated in the document
+bool json::document::add(const json::value * object, const char * name, size_t length,
+                         const json::value * element) noexcept
+{
+    if (!attachable(object, element) || !reserve(object))
+        return false;
+
+    json_value *container = mutable_value(object);
+    ::object_entry &entry = container->u.object.values[container->u.object.length++];
+    entry.name = const_cast<char *>(name);
+    entry.name_length = length;
+    entry.value = mutable_value(element);
+    entry.value->parent = container;
+    return true;
+}
+
+bool json::document::remove(const json::value * object, const char * name, size_t length) noexcept
+{
+    if (!object || object->type != json_object)
+        return false;
+
+    for (unsigned int i = 0; i < object->u.object.length; ++i) {
+        const json::object_entry &entry = object->u.object.values[i];
+        if (entry.name_length == length && !std::memcmp(entry.name, name, length))
+            return remove(object, i);
+    }
+
+    return false;
+}
+
+bool json::document::merge_patch(const json::value * patch) noexcept
+{
+    if (!patch || patch->type != json_object) {
+        const json::value *value = patch ? copy(patch) : make_null();
+        return value && set_root(value);
+    }
+
+    if (!root_value || root_value->type != json_object) {
+        const json::value *object = make_object();
+        if (!object)
+            return false;
+
+        root_value = object;
+    }
+
+    // Walk objects of the patch, following with matching objects of the target
+    index_stack stack;
+    const json::value *target = root_value;
+    unsigned int index = 0;
+
+    for (;;) {
+        if (index < patch->u.object.length) {
+            const json::object_entry &entry = patch->u.object.values[index];
+
+            if (entry.value->type == json_null) {
+                remove(target, entry.name, entry.name_length);
+            } else if (entry.value->type == json_object) {
+                const json::value *member = json::find(target, entry.name, entry.name_length);
+                if (!member || member->type != json_object) {
+                    member = make_object();
+                    if (!member || !set(target, entry.name, entry.name_length, member))
+                        return false;
+                }
+
+                stack.push(index);
+                target = member;
+                patch = entry.value;
+                index = 0;
+                continue;
+            } else {
+                const json::value *member = copy(entry.value);
+                if (!member || !set(target, entry.name, entry.name_length, member))
+                    return false;
+            }
+
+            ++index;
+            continue;
+        }
+
+        if (!stack.depth)
+            return true;
+
+        index = stack.pop(patch) + 1;
+        patch = patch->parent;
+        target = target->parent;
+    }
+}
+
+// Adds value at location referenced by JSON pointer, replacing existing object member
+bool json::document::add_at(const char * path, size_t length, const json::value * element) noexcept
+{
+    if (!length)
+        return set_root(element);
+
+    const char *token;
+    std::size_t token_length;
+    const json::value *parent = pointer_parent(root_value, path, length, &token, &token_length);
+    if (!parent)
+        return false;
+
+    if (parent->type == json_object) {
+        const unsigned int index = token_member(parent, token, token_length);
+        if (index != ~0u)
+            return replace(parent, index, element);
+
+        char *name = (char *) allocate(token_length + 1);
+        if (!name)
+            return false;
+
+        std::size_t name_length = 0;
+        for (const char *ptr = token, *const end = token + token_length; ptr < end; ) {
+            const int c = token_char(&ptr, end);
+            if (c < 0)
+                return false;
+
+            name[name_length++] = c;
+        }
+
+        name[name_length] = 0;
+        return add(parent, name, name_length, element);
+    }
+
+    unsigned int index;
+    if (parent->type != json_array)
+        return false;
+    else if (token_length == 1 && *token == '-')
+        index = parent->u.array.length;
+    else if (!token_index(token, token_length, &index))
+        return false;
+
+    return insert(parent, index, element);
+}
+
+// Removes value referenced by JSON pointer from its container and returns it
+const json::value * json::document::detach(const char * path, size_t length) noexcept
+{
+    const json::value *value = root_value;
+    if (!length) {
+        root_value = nullptr;
+        return value;
+    }
+
+    unsigned int index;
+    const json::value *parent = pointer_element(root_value, path, length, &index);
+    if (!parent)
+        return nullptr;
+
+    value = parent->type == json_object ? parent->u.object.values[index].value : parent->u.array.values[index];
+    remove(parent, index);
+    return value;
+}
+
+// Puts element removed by remove(container, index) back, with its name if in an object. The
+// table still has room for it, as removing does not shrink it.
+void json::document::reattach(const json::value * target, unsigned int index,
+                              const json::object_entry & entry) noexcept
+{
+    json_value *container = mutable_value(target);
+    const unsigned int tail = container->u.array.length - index;
+
+    if (container->type == json_object) {
+        ::object_entry *values = container->u.object.values;
+        std::memmove(values + index + 1, values + index, tail * sizeof(*values));
+        values[index].name = const_cast<char *>(entry.name);
+        values[index].name_length = entry.name_length;
+        values[index].value = mutable_value(entry.value);
+    } else {
+        json_value **values = container->u.array.values;
+        std::memmove(values + index + 1, values + index, tail * sizeof(*values));
+        values[index] = mutable_value(entry.value);
+    }
+
+    mutable_value(entry.value)->parent = container;
+    ++container->u.array.length;
+}
+
+bool json::document::apply_patch(const json::value * patch, json::patch_error & error) noexcept
+{
+    error = json::patch_error();
+
+    if (!patch || patch->type != json_array) {
+        error.code = json::patch_error_not_array;
+        return false;
+    }
+
+    for (unsigned int i = 0; i < patch->u.array.length; ++i) {
+        error.operation = i;
+
+        const json::value *operation = patch->u.array.values[i];
+        const json::value *op = json::find(operation, "op", 2);
+        const json::value *path = json::find(operation, "path", 4);
+        const json::value *from = json::find(operation, "from", 4);
+        const json::value *value = json::find(operation, "value", 5);
+
+        if (!op || op->type != json_string || !path || path->type != json_string) {
+            error.code = json::patch_error_missing_op;
+            return false;
+        }
+
+        // compared with its length, so that "add\u0000x" is not taken for "add"
+        const std::string_view name(op->u.string.ptr, op->u.string.length);
+        const char *const target = path->u.string.ptr;
+        const std::size_t target_length = path->u.string.length;
+
+        if (name == "add" || name == "replace") {
+            if (!value) {
+                error.code = json::patch_error_missing_value;
+                return false;
+            }
+
+            if (name[0] == 'r' && target_length) {
+                unsigned int index;
+                const json::value *parent = pointer_element(root_value, target, target_length, &index);
+                if (!parent) {
+                    error.code = json::patch_error_path_not_found;
+                    return false;
+                }
+
+                if (!(value = copy(value)) || !replace(parent, index, value)) {
+                    error.code = json::patch_error_memory;
+                    return false;
+                }
+            } else if (name[0] == 'r' && !root_value) {
+                error.code = json::patch_error_path_not_found;
+                return false;
+            } else if (!(value = copy(value))) {
+                error.code = json::patch_error_memory;
+                return false;
+            } else if (!add_at(target, target_length, value)) {
+                error.code = json::patch_error_cannot_add;
+                return false;
+            }
+        } else if (name == "remove") {
+            if (!detach(target, target_length)) {
+                error.code = json::patch_error_path_not_found;
+                return false;
+            }
+        } else if (name == "move" || name == "copy") {
+            if (!from || from->type != json_string) {
+                error.code = json::patch_error_missing_from;
+                return false;
+            }
+
+            const char *const source = from->u.string.ptr;
+            const std::size_t source_length = from->u.string.length;
+
+            if (name[0] == 'm') {
+                if (source_length == target_length && !std::memcmp(source, target, target_length)) {
+                    if (!json::pointer(root_value, source, source_length)) {
+                        error.code = json::patch_error_from_not_found;
+                        return false;
+                    }
+
+                    continue;
+                }
+
+                if (source_length < target_length && !std::memcmp(source, target, source_length)
+                    && target[source_length] == '/') {
+                    error.code = json::patch_error_move_into_itself;
+                    return false;
+                }
+
+                // the target is resolved only after the value is taken out, as that can shift
+                // indices in the same array; if it fails, the value is put back
+                unsigned int index;
+                const json::value *parent = pointer_element(root_value, source, source_length, &index);
+                if (!parent) {
+                    error.code = json::patch_error_from_not_found;
+                    return false;
+                }
+
+                const json::object_entry moved = parent->type == json_object
+                                                 ? parent->u.object.values[index]
+                                                 : json::object_entry { nullptr, 0, parent->u.array.values[index] };
+                remove(parent, index);
+
+                if (!add_at(target, target_length, moved.value)) {
+                    reattach(parent, index, moved);
+                    error.code = json::patch_error_cannot_add;
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (!(value = json::pointer(root_value, source, source_length))) {
+                error.code = json::patch_error_from_not_found;
+                return false;
+            }
+
+            if (!(value = copy(value))) {
+                error.code = json::patch_error_memory;
+                return false;
+            }
+
+            if (!add_at(target, target_length, value)) {
+                error.code = json::patch_error_cannot_add;
+                return false;
+            }
+        } else if (name == "test") {
+            if (!value) {
+                error.code = json::patch_error_missing_value;
+                return false;
+            }
+
+            const json::value *current = json::pointer(root_value, target, target_length);
+            if (!current) {
+                error.code = json::patch_error_path_not_found;
+                return false;
+            }
+
+            if (!json::equal(current, value)) {
+                error.code = json::patch_error_test_failed;
+                return false;
+            }
+        } else {
+            error.code = json::patch_error_unknown_op;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool json::document::apply_patch(const json::value * patch, char * error_buf) noexcept
+{
+    json::patch_error error;
+    if (apply_patch(patch, error))
+        return true;
+
+    if (error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return false;
+}
+
+std::size_t json::to_string(const json::patch_error & error, char * buffer, size_t size) noexcept
+{
+    static const char *const messages[] = {
+        "No error",
+        "Memory allocation failure",
+        "Patch is not an array",
+        "Missing `op` or `path`",
+        "Unknown `op`",
+        "Missing `value`",
+        "Missing `from`",
+        "Path not found",
+        "Value at `from` not found",
+        "Cannot add value at path",
+        "Cannot move value into itself",
+        "Test failed",
+    };
+    static_assert(sizeof(messages) / sizeof(messages[0]) == json::patch_error_test_failed + 1);
+
+    json::writer out(buffer, size ? size - 1 : 0);
+    const char *const message = messages[error.code <= json::patch_error_test_failed ? error.code : 0];
+
+    if (error.code != json::patch_error_none && error.code != json::patch_error_not_array) {
+        out.put("Operation ", 10);
+        json::write_unsigned(out, error.operation);
+        out.put(": ", 2);
+    }
+
+    out.put(message, std::strlen(message));
+
+    if (size)
+        buffer[out.ptr - buffer] = '\0';
+
+    return out.length;
+}
+
+struct json::shared::control {
+    std::atomic<std::size_t> refs;
+    json::document doc;
+    const char *input;
+    std::size_t length;
+};
+
+json::shared::shared(json::document && doc) noexcept
+        : ctl((control *) doc.settings.mem_alloc(sizeof(control), false, doc.settings.user_data))
+{
+    if (ctl)
+        new (ctl) control{ { 1 }, std::move(doc), nullptr, 0 };
+}
+
+json::shared::shared(const json::shared & other) noexcept
+        : ctl(other.ctl)
+{
+    if (ctl)
+        ctl->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+json::shared & json::shared::operator=(const json::shared & other) noexcept
+{
+    if (other.ctl)
+        other.ctl->refs.fetch_add(1, std::memory_order_relaxed);
+
+    reset();
+    ctl = other.ctl;
+    return *this;
+}
+
+json::shared & json::shared::operator=(json::shared && other) noexcept
+{
+    if (this != &other) {
+        reset();
+        ctl = other.ctl;
+        other.ctl = nullptr;
+    }
+
+    return *this;
+}
+
+json::shared::~shared()
+{
+    reset();
+}
+
+void json::shared::reset() noexcept
+{
+    if (ctl && ctl->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        const json::settings settings = ctl->doc.settings;
+        ctl->~control();
+        settings.mem_free(ctl, settings.user_data);
+    }
+
+    ctl = nullptr;
+}
+
+json::shared json::shared::parse(const json::settings & settings, const char * json, size_t length,
+                                 json::parse_error & error, bool keep_input) noexcept
+{
+    json::document doc(settings);
+    const char *input = json;
+
+    if (keep_input) {
+        char *copy = (char *) doc.allocate(length ? length : 1);
+        if (!copy)
+            goto e_alloc_failure;
+
+        std::memcpy(copy, json, length);
+        input = copy;
+    }
+
+    if (!doc.parse(input, length, error))
+        return shared();
+
+    {
+        shared result(std::move(doc));
+        if (result.ctl) {
+            if (keep_input) {
+                result.ctl->input = input;
+                result.ctl->length = length;
+            }
+
+            return result;
+        }
+    }
+
+e_alloc_failure:
+    error = json::parse_error();
+    error.code = json::error_memory;
+    return shared();
+}
+
+json::shared json::shared::parse(const json::settings & settings, const char * json, size_t length,
+                                 char * error_buf, bool keep_input) noexcept
+{
+    json::parse_error error;
+    json::shared result = parse(settings, json, length, error, keep_input);
+
+    if (result.empty() && error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return result;
+}
+
+const json::value * json::shared::root() const noexcept
+{
+    return ctl ? ctl->doc.root() : nullptr;
+}
+
+std::string_view json::shared::input() const noexcept
+{
+    return ctl ? std::string_view(ctl->input, ctl->length) : std::string_view();
+}
+
+// Readers announce themselves in the counter of the current epoch for just as long as it
+// takes to load the document and take a reference to it. The writer swaps the document first
+// and advances the epoch, so that new readers count themselves in the other counter, then
+// waits for the counter of the previous epoch to drain: after that no reader can still be
+// about to take a reference to the previous document. Readers recheck the epoch after
+// announcing themselves, so that one delayed across several stores cannot be missed.
+json::shared_slot::shared_slot(json::shared document) noexcept
+        : current(document.ctl), readers{}, epoch(0)
+{
+    document.ctl = nullptr;
+}
+
+json::shared_slot::~shared_slot()
+{
+    json::shared(current.load(std::memory_order_relaxed));
+}
+
+json::shared json::shared_slot::load() const noexcept
+{
+    for (;;) {
+        const std::size_t e = epoch.load();
+        readers[e & 1].fetch_add(1);
+
+        if (epoch.load() == e) {
+            json::shared::control *ctl = current.load();
+            if (ctl)
+                ctl->refs.fetch_add(1, std::memory_order_relaxed);
+
+            readers[e & 1].fetch_sub(1, std::memory_order_release);
+            return json::shared(ctl);
+        }
+
+        readers[e & 1].fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+json::shared json::shared_slot::exchange(json::shared document) noexcept
+{
+    std::lock_guard<std::mutex> lock(writer);
+
+    json::shared previous(current.exchange(document.ctl));
+    document.ctl = nullptr;
+
+    const std::size_t e = epoch.fetch_add(1);
+    while (readers[e & 1].load())
+        std::this_thread::yield();
+
+    return previous;
+}
+
+json::node json::node::find(const char * name, size_t length) const noexcept
+{
+    if (type() != json_object)
+        return json::node();
+
+    const std::string_view wanted(name, length);
+    for (unsigned int i = 0; i < cell->length; ++i) {
+        if (this->name(i) == wanted)
+            return (*this)[i];
+    }
+
+    return json::node();
+}
+
+json::compact::compact(const json::settings & settings) noexcept
+        : settings(settings), buffer(nullptr), buffer_size(0)
+{
+    default_allocator(this->settings);
+}
+
+json::compact::compact(json::compact && other) noexcept
+        : settings(other.settings), buffer(other.buffer), buffer_size(other.buffer_size)
+{
+    other.buffer = nullptr;
+    other.buffer_size = 0;
+}
+
+json::compact & json::compact::operator=(json::compact && other) noexcept
+{
+    if (this != &other) {
+        clear();
+        settings = other.settings;
+        buffer = other.buffer;
+        buffer_size = other.buffer_size;
+        other.buffer = nullptr;
+        other.buffer_size = 0;
+    }
+
+    return *this;
+}
+
+json::compact::~compact()
+{
+    clear();
+}
+
+void json::compact::clear() noexcept
+{
+    if (buffer)
+        settings.mem_free(buffer, settings.user_data);
+
+    buffer = nullptr;
+    buffer_size = 0;
+}
+
+namespace {
+    constexpr std::size_t short_string_max = 14;
+}
+
+// Values are laid out in a single pass: cells of values whose container is still open are kept
+// on a stack growing from the start of the buffer, and when the container ends they are moved
+// to its table, placed just below tables of containers which ended before. As each cell is
+// either on the stack or in a table, both fit in the buffer exactly, with the root value left
+// in the first cell.
+bool json::compact::parse(const char * json, size_t length, json::parse_error & error) noexcept
+{
+    error = json::parse_error();
+    const char *const input = json;
+    const std::size_t input_length = length;
+
+    char *values = nullptr;
+    std::size_t *opened = nullptr;
+    const char *ptr;
+
+    {
+        json::settings syntax = settings;
+        syntax.json5 = false;  // values are read as standard JSON
+
+        if (!json::validate(syntax, input, input_length, error))
+            goto e_failed;
+    }
+
+    skip_bom(json, length);
+
+    {
+        const char *const end = json + length;
+        const bool comments = settings.allow_comments;
+
+        std::size_t cells = 0;
+        std::size_t chars = 0;
+        unsigned int depth = 0;
+        unsigned int max_depth = 0;
+
+        for (ptr = skip_space(json, end, comments); ptr < end; ptr = skip_space(ptr, end, comments)) {
+            switch (*ptr) {
+                case '"': {
+                    const char *const string_end = skip_value(ptr, end, false);
+                    if (std::size_t(string_end - ptr - 2) > short_string_max)
+                        chars += string_end - ptr - 1;
+
+                    ++cells;
+                    ptr = string_end;
+                    break;
+                }
+                case '{': case '[':
+                    ++cells;
+                    if (++depth > max_depth)
+                        max_depth = depth;
+                    ++ptr;
+                    break;
+                case '}': case ']':
+                    --depth;
+                    ++ptr;
+                    break;
+                case ',': case ':':
+                    ++ptr;
+                    break;
+                default:
+                    ++cells;
+                    ptr = skip_value(ptr, end, comments);
+            }
+        }
+
+        const std::size_t size = cells * sizeof(json::cell) + chars;
+        if (settings.max_memory && size > settings.max_memory)
+            goto e_alloc_failure;
+
+        if (!(values = (char *) settings.mem_alloc(size, false, settings.user_data)))
+            goto e_alloc_failure;
+
+        if (max_depth && !(opened = (std::size_t *) settings.mem_alloc(max_depth * sizeof(std::size_t),
+                                                                        false, settings.user_data))) {
+            goto e_alloc_failure;
+        }
+
+        json::cell *const table = (json::cell *) values;
+        char *string = values + cells * sizeof(json::cell);
+        std::size_t top = 0;
+        std::size_t bottom = cells;
+
+        for (ptr = skip_space(json, end, comments); ptr < end; ptr = skip_space(ptr, end, comments)) {
+            if (*ptr == ',' || *ptr == ':') {
+                ++ptr;
+                continue;
+            }
+
+            if (*ptr == '{' || *ptr == '[') {
+                opened[depth++] = top;
+                ++ptr;
+                continue;
+            }
+
+            if (*ptr == '}' || *ptr == ']') {
+                const std::size_t first = opened[--depth];
+                const std::size_t count = top - first;
+
+                bottom -= count;
+                std::memmove(table + bottom, table + first, count * sizeof(json::cell));
+                top = first;
+
+                json::cell &cell = table[top++] = json::cell();
+                cell.offset = bottom * sizeof(json::cell);
+                cell.length = *ptr == '}' ? count / 2 : count;
+                cell.tag = *ptr == '}' ? json_object : json_array;
+                ++ptr;
+                continue;
+            }
+
+            json::cell &cell = table[top++] = json::cell();
+            const char *const value_end = skip_value(ptr, end, comments);
+
+            switch (*ptr) {
+                case '"': {
+                    // only strings longer than that before unescaping have space reserved
+                    if (std::size_t(value_end - ptr - 2) <= short_string_max) {
+                        cell.tag = json_string | (decode_string(ptr + 1, value_end - 1, (char *) &cell) << 4);
+                        break;
+                    }
+
+                    const std::size_t decoded = decode_string(ptr + 1, value_end - 1, string);
+                    if (decoded <= short_string_max) {
+                        std::memcpy(&cell, string, decoded);
+                        cell.tag = json_string | (decoded << 4);
+                    } else {
+                        string[decoded] = 0;
+                        cell.offset = string - values;
+                        cell.length = decoded;
+                        cell.tag = json_string | 0xF0;
+                        string += decoded + 1;
+                    }
+                    break;
+                }
+                case 't':
+                    cell.integer = 1;
+                    cell.tag = json_boolean;
+                    break;
+                case 'f':
+                    cell.tag = json_boolean;
+                    break;
+                case 'n':
+                    cell.tag = json_null;
+                    break;
+                default:
+                    cell.tag = convert_number(ptr, value_end, cell.integer, cell.dbl);
+            }
+
+            ptr = value_end;
+        }
+
+        if (opened)
+            settings.mem_free(opened, settings.user_data);
+
+        clear();
+        buffer = values;
+        buffer_size = size;
+        return true;
+    }
+
+e_alloc_failure:
+    error.code = json::error_memory;
+    error.offset = 0;
+    error.line = error.col = 0;
+
+e_failed:
+    if (values)
+        settings.mem_free(values, settings.user_data);
+
+    return false;
+}
+
+bool json::compact::parse(const char * json, size_t length, char * error_buf) noexcept
+{
+    json::parse_error error;
+    const bool result = parse(json, length, error);
+
+    if (!result && error_buf)
+        json::to_string(error, error_buf, json::error_max);
+
+    return result;
 }
@@ -31,8 +31,16 @@
 #ifndef _JSON_HPP
 #define _JSON_HPP
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 
 namespace json {
 
@@ -46,6 +54,22 @@ namespace json {
 
         void *user_data;  // will be passed to mem_alloc and mem_free
         std::size_t value_extra;  //  how much extra space to allocate for values?
+
+        bool strict_utf8;  // reject invalid UTF-8, control characters and unknown escapes in strings
+
+        // Limits enforced while scanning the input, before anything is allocated (0 means no limit)
+        unsigned int max_depth;  // nesting of arrays and objects
+        unsigned long max_values;  // total number of values in the document
+        unsigned int max_elements;  // number of elements in a single array or object
+        unsigned int max_string_length;  // in bytes after unescaping, also applies to names
+        unsigned int max_number_length;  // in characters
+
+        uint64_t *hash;  // if set, receives json::hash of the parsed value, computed while parsing
+        bool hash_ordered;  // ... with `ordered` set
+
+        bool json5;  // accept JSON5: comments, unquoted names, single quotes, hexadecimal, Infinity, NaN
+        bool track_source;  // store json::source_location of each value, see json::location
+        bool exact_numbers;  // keep numbers as their text (json_number), see json::to_decimal
     };
 
     enum type {
@@ -57,6 +81,7 @@ namespace json {
         json_string,
         json_boolean,
         json_null,
+        json_number,  // text of a number, parsed with settings.exact_numbers
     };
 
     struct value;
@@ -82,6 +107,11 @@ namespace json {
                 const char *ptr; // null terminated
             } string;
 
+            struct {
+                unsigned int length;
+                const char *ptr;  // in the input, not null terminated
+            } number;
+
             struct {
                 unsigned int length;
                 const object_entry *values;
@@ -97,20 +127,818 @@ namespace json {
             const void *reserved;
         } _reserved;
 
-#ifdef JSON_TRACK_SOURCE
-        // Location of the value in the source JSON
-        unsigned int line, col;
+#ifdef JSON_TRACK_SPAN
+        // Position and length of the text of the value in the source JSON
+        std::size_t offset, length;
 #endif
     };
     static_assert(std::is_standard_layout_v<value>);
 
+    // Line and column (in bytes) of the first character of a value, both counted from 1
+    struct source_location {
+        unsigned int line, col;
+    };
+
+    // Location of a value parsed with settings.track_source, stored right after it (and before
+    // the space of settings.value_extra); other values do not have any
+    inline const source_location &location(const value *value) noexcept {
+        return *reinterpret_cast<const source_location *>(value + 1);
+    }
+
+#ifdef JSON_TRACK_SPAN
+    // Text of the value in the source JSON passed to json::parse, which must still be around
+    inline std::string_view source(const char *json, const value *value) noexcept {
+        return std::string_view(json + value->offset, value->length);
+    }
+#endif
+
+    enum error_code {
+        error_none,
+        error_memory,
+        error_eof_in_string,
+        error_invalid_character,  // in escape sequence
+        error_invalid_surrogate,
+        error_control_char,
+        error_invalid_utf8,
+        error_eof_in_comment,
+        error_comment_not_allowed,
+        error_comment_opening,
+        error_eof,
+        error_trailing_garbage,
+        error_unexpected_bracket,
+        error_expected_comma,
+        error_expected_colon,
+        error_unexpected_value,
+        error_unexpected_in_object,
+        error_unknown_value,
+        error_leading_zero,
+        error_digit_before_point,
+        error_digit_after_point,
+        error_digit_after_exponent,
+        error_digit_after_minus,
+        error_too_deep,
+        error_too_many_values,
+        error_too_many_elements,
+        error_number_too_long,
+        error_string_too_long,
+        error_overflow,
+        error_invalid_number,  // in JSON5 syntax
+        error_expected_records,  // reported by json::extract
+        error_invalid_column_path,
+        error_invalid_column_type,
+    };
+
+    // Filled in when parsing fails, without formatting anything
+    struct parse_error {
+        error_code code;
+        std::size_t offset;  // from the start of the input, in bytes
+        unsigned int line, col;  // both counted from 1, column in bytes
+        char character;  // offending character, 0 at the end of input or if not applicable
+    };
+
+    // Formats error message into `buffer` like std::snprintf, returns its full length
+    std::size_t to_string(const parse_error &error, char *buffer, std::size_t size) noexcept;
+
     const value *parse(const char *json, std::size_t length) noexcept;
+    const value *parse(const settings &settings, const char *json, std::size_t length, parse_error &error) noexcept;
+
+    // Same, with formatted message written into `error` (truncated to error_max characters)
     constexpr static int error_max = 128;
     const value *parse(const settings &settings, const char *json, std::size_t length, char *error) noexcept;
 
     void value_free(const value *) noexcept;
     void value_free(const settings &settings, const value *) noexcept;
 
+    // Parses input in steps, each processing a bounded part of it, so that parsing of large
+    // documents can be interleaved with other work, e.g. on an event loop or in a coroutine:
+    //
+    //     parser.start(json, length);
+    //     while (!parser.step(64 * 1024))
+    //         co_await yield();
+    class parser {
+    public:
+        struct context;
+
+        explicit parser(const json::settings &settings = json::settings()) noexcept;
+        parser(parser &&other) noexcept;
+        parser &operator=(parser &&other) noexcept;
+        ~parser();
+
+        parser(const parser &) = delete;
+        parser &operator=(const parser &) = delete;
+
+        // Starts parsing the input, which must remain available until parsing is done.
+        // Any parsing in progress is abandoned, and the previous result freed.
+        bool start(const char *json, std::size_t length) noexcept;
+
+        // Parses about `budget` more bytes of input; as the input is read twice, the whole
+        // document takes twice its length. Returns true when parsing is done, successfully
+        // (root() is set) or not (error() is set).
+        bool step(std::size_t budget) noexcept;
+
+        const value *root() const noexcept { return root_value; }
+        const parse_error &error() const noexcept { return failure; }
+
+        // Passes ownership of the result to the caller, to be freed by json::value_free
+        const value *release() noexcept;
+        void clear() noexcept;
+
+    private:
+        json::settings settings;
+        context *ctx;
+        const value *root_value;
+        parse_error failure;
+    };
+
+    // Checks whether input is well formed, without allocating any memory
+    bool validate(const char *json, std::size_t length) noexcept;
+    bool validate(const settings &settings, const char *json, std::size_t length, parse_error &error) noexcept;
+    bool validate(const settings &settings, const char *json, std::size_t length, char *error) noexcept;
+
+    // Output buffer for serialization. Writes at most `size` characters into `buffer`
+    // but keeps counting past the end, so `length` is always the size required to
+    // hold the complete output (like std::snprintf). Output is not null terminated.
+    struct writer {
+        char *ptr;
+        char *end;
+        std::size_t length;
+
+        writer(char *buffer, std::size_t size) noexcept
+                : ptr(buffer), end(buffer + size), length(0) {}
+
+        void put(const char *str, std::size_t n) noexcept {
+            if (std::size_t(end - ptr) >= n) {
+                std::memcpy(ptr, str, n);
+                ptr += n;
+            } else
+                ptr = end;  // truncated, only counting from now on
+
+            length += n;
+        }
+
+        void put(char c) noexcept {
+            if (ptr != end)
+                *ptr++ = c;
+            length += 1;
+        }
+    };
+
+    // Writes escaped form of `c` (as it should appear inside JSON string) into `out`,
+    // which must have room for at least 6 characters. Returns number of characters written.
+    constexpr std::size_t escape_char(char c, char *out) noexcept {
+        constexpr char hex[] = "0123456789abcdef";
+
+        switch (c) {
+            case '"': out[0] = '\\'; out[1] = '"'; return 2;
+            case '\\': out[0] = '\\'; out[1] = '\\'; return 2;
+            case '\b': out[0] = '\\'; out[1] = 'b'; return 2;
+            case '\f': out[0] = '\\'; out[1] = 'f'; return 2;
+            case '\n': out[0] = '\\'; out[1] = 'n'; return 2;
+            case '\r': out[0] = '\\'; out[1] = 'r'; return 2;
+            case '\t': out[0] = '\\'; out[1] = 't'; return 2;
+            default:
+                if ((unsigned char) c >= 0x20) {
+                    out[0] = c;
+                    return 1;
+                }
+
+                out[0] = '\\'; out[1] = 'u'; out[2] = '0'; out[3] = '0';
+                out[4] = hex[(unsigned char) c >> 4];
+                out[5] = hex[(unsigned char) c & 0x0F];
+                return 6;
+        }
+    }
+
+    void write_string(writer &out, const char *str, std::size_t length) noexcept;
+    void write_integer(writer &out, int64_t value) noexcept;
+    void write_unsigned(writer &out, uint64_t value) noexcept;
+    void write_double(writer &out, double value) noexcept;  // non-finite written as null
+
+    // Finds member of an object by name, nullptr if not found
+    const value *find(const value *object, const char *name, std::size_t length) noexcept;
+
+    // Number as significand * 10^exponent, with the digits as written (1.50 is 150 * 10^-2)
+    struct decimal {
+        int64_t significand;
+        int exponent;
+    };
+
+    // Value of a number of any type, converted from the text of json_number when called.
+    // False if the value is not a number or does not fit: to_integer needs an integral value
+    // in range of int64_t, to_decimal exact digits fitting int64_t (so not a json_double).
+    bool to_integer(const value *value, int64_t &integer) noexcept;
+    bool to_double(const value *value, double &dbl) noexcept;
+    bool to_decimal(const value *value, decimal &decimal) noexcept;
+
+    // Walks a tree in document order, without recursion and without modifying it. Arrays and
+    // objects are visited twice: before their elements, and after them with leaving() set.
+    //
+    //     for (json::walker walker(root); walker.next(); )
+    //         if (!walker.leaving())
+    //             ... walker.value() ...
+    class walker {
+    public:
+        explicit walker(const value *root) noexcept
+                : root(root), current(nullptr), position(0), level(0), left(false) {}
+
+        // Moves to the next value, false when there are no more
+        bool next() noexcept {
+            if (!current) {
+                current = root;
+                root = nullptr;
+                return current;
+            }
+
+            // into the first element of array or object just visited
+            if (!left && (current->type == json_object || current->type == json_array)) {
+                if (current->u.array.length) {
+                    if (level < saved_max)
+                        saved[level] = position;
+
+                    ++level;
+                    position = 0;
+                    current = current->type == json_object ? current->u.object.values[0].value
+                                                           : current->u.array.values[0];
+                    return true;
+                }
+
+                left = true;
+                return true;
+            }
+
+            if (!level)
+                return false;
+
+            // to the next sibling, or up to the parent
+            const json::value *parent = current->parent;
+            if (++position < parent->u.array.length) {
+                current = parent->type == json_object ? parent->u.object.values[position].value
+                                                      : parent->u.array.values[position];
+                left = false;
+                return true;
+            }
+
+            current = parent;
+            left = true;
+            --level;
+            position = level < saved_max ? saved[level] : index_of(parent);
+            return true;
+        }
+
+        const json::value *value() const noexcept { return current; }
+        bool leaving() const noexcept { return left; }
+
+        // Depth of the value below the root, its index in parent, and member holding it if
+        // the parent is an object (nullptr for the root and array elements)
+        unsigned int depth() const noexcept { return level; }
+        unsigned int index() const noexcept { return position; }
+        const object_entry *member() const noexcept {
+            return level && current->parent->type == json_object
+                   ? &current->parent->u.object.values[position] : nullptr;
+        }
+
+        // Continues after the array or object just visited, without visiting its elements
+        // (nor visiting it again when leaving)
+        void skip() noexcept { left = true; }
+
+        // Index of a value in its parent, found by scanning the parent's elements
+        static unsigned int index_of(const json::value *child) noexcept;
+
+    private:
+        // indices of the innermost ancestors, deeper ones are found again by scanning parents
+        constexpr static unsigned int saved_max = 64;
+
+        const json::value *root;
+        const json::value *current;
+        unsigned int position;
+        unsigned int level;
+        bool left;
+        unsigned int saved[saved_max];
+    };
+
+    // Calls enter(walker) for each value in document order, and leave(walker) for each array
+    // and object after its elements; enter can call walker.skip()
+    template<typename Enter, typename Leave>
+    void walk(const value *root, Enter &&enter, Leave &&leave) {
+        for (walker walker(root); walker.next(); ) {
+            if (walker.leaving())
+                leave(static_cast<const json::walker &>(walker));
+            else
+                enter(walker);
+        }
+    }
+
+    // Writes json::value tree (also used when serializing members of type `const json::value *`)
+    void write(writer &out, const value *value) noexcept;
+
+    // Compares two trees: object members in any order unless `ordered` is set, and numbers
+    // by value (so 1 equals 1.0)
+    bool equal(const value *a, const value *b, bool ordered = false) noexcept;
+
+    // Structural hash, equal for trees which compare equal (with the same `ordered` setting).
+    // The same on every run, but not across platforms of different endianness.
+    uint64_t hash(const value *value, bool ordered = false) noexcept;
+
+    enum diff_kind {
+        diff_added,  // value only in `b`
+        diff_removed,  // value only in `a`
+        diff_changed,  // values of different type, or different scalars
+    };
+
+    typedef void (*diff_callback)(diff_kind kind, const value *a, const value *b, void *user_data);
+
+    // Reports differences between two trees; arrays are compared element by element, so
+    // inserting into an array shows as changes of all following elements
+    void diff(const value *a, const value *b, diff_callback callback, void *user_data) noexcept;
+
+    // Writes RFC 6901 JSON pointer of the value within its tree
+    void write_pointer(writer &out, const value *value) noexcept;
+
+    // Resolves RFC 6901 JSON pointer, e.g. "/foo/0/a~1b"; empty path refers to root
+    const value *pointer(const value *root, const char *path, std::size_t length) noexcept;
+
+    // Writes input document with RFC 7386 merge patch applied, without building a tree of
+    // the input: text of values the patch does not touch is copied unchanged. Limits set in
+    // `settings` apply to each copied value separately.
+    bool merge_patch(const settings &settings, const char *json, std::size_t length,
+                     const value *patch, writer &out, char *error) noexcept;
+
+    enum column_type {
+        column_integer,  // integers only, within range of int64_t
+        column_double,   // any number
+        column_boolean,
+        column_string
+    };
+
+    // Column of values found at the same path in each record of an array. Row i is valid
+    // (its bit `valid[i / 8] & (1 << i % 8)` set) if its record had a value of matching type
+    // there; values of other rows are zero (or empty strings).
+    struct column {
+        const char *path;  // RFC 6901 JSON pointer within the record, e.g. "/quote/bid"
+        std::size_t path_length;
+        column_type type;
+
+        // Filled by json::extract, to be freed by json::column_free
+        union {
+            int64_t *integers;
+            double *doubles;
+            bool *booleans;
+            std::size_t *offsets;  // string of row i is chars[offsets[i], offsets[i + 1])
+        };
+        char *chars;
+        uint8_t *valid;
+        std::size_t null_count;
+    };
+
+    // Extracts columns from input which is an array of records, without building a tree:
+    // only values at given paths are decoded, and only objects on these paths are entered.
+    // Input is checked like json::validate does, with limits applying to each value separately.
+    bool extract(const settings &settings, const char *json, std::size_t length,
+                 column *columns, std::size_t count, std::size_t *rows, parse_error &error) noexcept;
+    bool extract(const settings &settings, const char *json, std::size_t length,
+                 column *columns, std::size_t count, std::size_t *rows, char *error) noexcept;
+    void column_free(const settings &settings, column *columns, std::size_t count) noexcept;
+
+    // Pre-escaped JSON text, built at compile time by json::field and json::enumerator
+    template<std::size_t N>
+    struct token {
+        char str[N];
+        std::size_t length;
+    };
+
+    template<std::size_t Size, std::size_t N>
+    constexpr token<Size> make_token(char lead, const char (&name)[N], char trail) noexcept {
+        token<Size> result = {};
+        if (lead)
+            result.str[result.length++] = lead;
+
+        result.str[result.length++] = '"';
+        for (std::size_t i = 0; i + 1 < N; ++i)
+            result.length += escape_char(name[i], result.str + result.length);
+
+        result.str[result.length++] = '"';
+        if (trail)
+            result.str[result.length++] = trail;
+
+        return result;
+    }
+
+    template<typename Class, typename Member, std::size_t N>
+    struct field_descriptor {
+        const char *name;
+        json::token<N> key;  // `,"name":`
+        Member Class::*member;
+    };
+
+    template<typename Enum, std::size_t N>
+    struct enumerator_descriptor {
+        const char *name;
+        json::token<N> str;  // `"name"`
+        Enum value;
+    };
+
+    template<typename Class, typename Member, std::size_t N>
+    constexpr field_descriptor<Class, Member, 6 * N> field(const char (&name)[N], Member Class::*member) noexcept {
+        return {name, make_token<6 * N>(',', name, ':'), member};
+    }
+
+    template<typename Enum, std::size_t N>
+    constexpr enumerator_descriptor<Enum, 6 * N> enumerator(const char (&name)[N], Enum value) noexcept {
+        static_assert(std::is_enum_v<Enum>);
+        return {name, make_token<6 * N>(0, name, 0), value};
+    }
+
+    template<typename ...Descriptors>
+    constexpr std::tuple<Descriptors...> fields(const Descriptors &...descriptors) noexcept {
+        return {descriptors...};
+    }
+
+    // Specialize for user types, providing a table of fields (for structs) or values (for enums):
+    //
+    //   template<> struct json::descriptor<point> {
+    //       static constexpr auto fields = json::fields(json::field("x", &point::x),
+    //                                                   json::field("y", &point::y));
+    //   };
+    //
+    //   template<> struct json::descriptor<color> {
+    //       static constexpr auto values = json::fields(json::enumerator("red", color::red),
+    //                                                   json::enumerator("green", color::green));
+    //   };
+    template<typename T>
+    struct descriptor;
+
+    namespace detail {
+        template<typename T, typename = void>
+        struct has_fields : std::false_type {};
+        template<typename T>
+        struct has_fields<T, std::void_t<decltype(descriptor<T>::fields)>> : std::true_type {};
+
+        template<typename T, typename = void>
+        struct has_values : std::false_type {};
+        template<typename T>
+        struct has_values<T, std::void_t<decltype(descriptor<T>::values)>> : std::true_type {};
+
+        template<typename T, typename = void>
+        struct is_optional : std::false_type {};
+        template<typename T>
+        struct is_optional<T, std::void_t<decltype(std::declval<const T &>().has_value()),
+                                          decltype(*std::declval<const T &>())>> : std::true_type {};
+
+        template<typename T, typename = void>
+        struct is_map : std::false_type {};
+        template<typename T>
+        struct is_map<T, std::void_t<typename T::key_type, typename T::mapped_type>>
+                : std::is_convertible<const typename T::key_type &, std::string_view> {};
+
+        template<typename T, typename = void>
+        struct is_range : std::false_type {};
+        template<typename T>
+        struct is_range<T, std::void_t<decltype(std::begin(std::declval<const T &>())),
+                                       decltype(std::end(std::declval<const T &>()))>> : std::true_type {};
+    }
+
+    template<typename T>
+    void write(writer &out, const T &value) noexcept {
+        if constexpr (std::is_same_v<T, bool>) {
+            if (value)
+                out.put("true", 4);
+            else
+                out.put("false", 5);
+        } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+            out.put("null", 4);
+        } else if constexpr (std::is_enum_v<T>) {
+            if constexpr (detail::has_values<T>::value) {
+                bool found = false;
+                std::apply([&](const auto &...e) {
+                    ((!found && e.value == value
+                      ? (out.put(e.str.str, e.str.length), found = true) : false), ...);
+                }, descriptor<T>::values);
+
+                if (found)
+                    return;
+            }
+
+            write(out, static_cast<std::underlying_type_t<T>>(value));
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            write_integer(out, value);
+        } else if constexpr (std::is_integral_v<T>) {
+            write_unsigned(out, value);
+        } else if constexpr (std::is_floating_point_v<T>) {
+            write_double(out, value);
+        } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+            if constexpr (std::is_pointer_v<T>) {
+                if (!value) {
+                    out.put("null", 4);
+                    return;
+                }
+            }
+
+            const std::string_view str = value;
+            write_string(out, str.data(), str.size());
+        } else if constexpr (detail::has_fields<T>::value) {
+            if constexpr (std::tuple_size_v<std::remove_const_t<decltype(descriptor<T>::fields)>> == 0) {
+                out.put("{}", 2);
+            } else {
+                std::apply([&](const auto &first, const auto &...rest) {
+                    out.put('{');
+                    out.put(first.key.str + 1, first.key.length - 1);  // skip leading comma
+                    write(out, value.*first.member);
+                    ((out.put(rest.key.str, rest.key.length), write(out, value.*rest.member)), ...);
+                }, descriptor<T>::fields);
+                out.put('}');
+            }
+        } else if constexpr (detail::is_optional<T>::value) {
+            if (value.has_value())
+                write(out, *value);
+            else
+                out.put("null", 4);
+        } else if constexpr (detail::is_map<T>::value) {
+            char separator = '{';
+            for (const auto &entry : value) {
+                const std::string_view name = entry.first;
+                out.put(separator);
+                write_string(out, name.data(), name.size());
+                out.put(':');
+                write(out, entry.second);
+                separator = ',';
+            }
+
+            if (separator == '{')
+                out.put('{');
+            out.put('}');
+        } else if constexpr (detail::is_range<T>::value) {
+            char separator = '[';
+            for (const auto &element : value) {
+                out.put(separator);
+                write(out, element);
+                separator = ',';
+            }
+
+            if (separator == '[')
+                out.put('[');
+            out.put(']');
+        } else {
+            static_assert(!sizeof(T), "json::write: no json::descriptor<T> for this type");
+        }
+    }
+
+    // Serializes `value` into `buffer` without building json::value tree. Returns the size of
+    // complete output; if it is larger than `size`, the output was truncated.
+    template<typename T>
+    std::size_t serialize(const T &value, char *buffer, std::size_t size) noexcept {
+        writer out(buffer, size);
+        write(out, value);
+        return out.length;
+    }
+
+    enum patch_error_code {
+        patch_error_none,
+        patch_error_memory,
+        patch_error_not_array,  // the patch itself
+        patch_error_missing_op,  // or path, or either is not a string
+        patch_error_unknown_op,
+        patch_error_missing_value,
+        patch_error_missing_from,
+        patch_error_path_not_found,
+        patch_error_from_not_found,
+        patch_error_cannot_add,
+        patch_error_move_into_itself,
+        patch_error_test_failed,
+    };
+
+    // Filled in when applying JSON Patch fails
+    struct patch_error {
+        patch_error_code code;
+        unsigned int operation;  // index of the failed operation in the patch
+    };
+
+    // Formats error message into `buffer` like std::snprintf, returns its full length
+    std::size_t to_string(const patch_error &error, char *buffer, std::size_t size) noexcept;
+
+    // Owns a tree of values allocated from an arena, that is chunks of memory obtained from
+    // settings.mem_alloc and released only together with the document. Values belonging to
+    // the document can be modified in place, and new values can be created in it.
+    class document {
+    public:
+        struct chunk;
+
+        explicit document(const json::settings &settings = json::settings()) noexcept;
+        document(document &&other) noexcept;
+        document &operator=(document &&other) noexcept;
+        ~document();
+
+        document(const document &) = delete;
+        document &operator=(const document &) = delete;
+
+        // Parses input into this document, replacing root value; memory of the previous
+        // tree is reclaimed only by clear() or when the document is destroyed
+        bool parse(const char *json, std::size_t length, parse_error &error) noexcept;
+        bool parse(const char *json, std::size_t length, char *error) noexcept;
+
+        const value *root() const noexcept { return root_value; }
+        bool set_root(const value *value) noexcept;
+        void clear() noexcept;
+
+        // New values, not attached to any container (nullptr if allocation failed)
+        const value *make_null() noexcept;
+        const value *make_boolean(bool boolean) noexcept;
+        const value *make_integer(int64_t integer) noexcept;
+        const value *make_double(double dbl) noexcept;
+        const value *make_string(const char *str, std::size_t length) noexcept;
+        const value *make_array() noexcept;
+        const value *make_object() noexcept;
+
+        // Deep copy of a value from any tree, including other documents
+        const value *copy(const value *source) noexcept;
+
+        // Change type and value in place; elements of arrays and objects changed this way are lost
+        void set_null(const value *target) noexcept;
+        void set_boolean(const value *target, bool boolean) noexcept;
+        void set_integer(const value *target, int64_t integer) noexcept;
+        void set_double(const value *target, double dbl) noexcept;
+        bool set_string(const value *target, const char *str, std::size_t length) noexcept;
+
+        // Elements added to arrays and objects must belong to this document and cannot be
+        // attached anywhere else; elements removed or replaced become unattached again.
+        bool append(const value *array, const value *element) noexcept;
+        bool insert(const value *array, unsigned int index, const value *element) noexcept;
+        bool replace(const value *container, unsigned int index, const value *element) noexcept;
+        bool remove(const value *container, unsigned int index) noexcept;
+
+        // Replaces member with the same name, or adds new one at the end of the object
+        bool set(const value *object, const char *name, std::size_t length, const value *element) noexcept;
+        bool remove(const value *object, const char *name, std::size_t length) noexcept;
+
+        // Applies RFC 7386 merge patch to the root value. Patch can belong to any tree.
+        bool merge_patch(const value *patch) noexcept;
+
+        // Applies RFC 6902 JSON Patch (array of operations) to the root value. Operations are
+        // applied in order, and those before a failed one are not rolled back.
+        bool apply_patch(const value *patch, patch_error &error) noexcept;
+        bool apply_patch(const value *patch, char *error) noexcept;  // formatted message
+
+    private:
+        friend class shared;
+
+        void *allocate(std::size_t size) noexcept;
+        void rewind(chunk *mark, std::size_t used) noexcept;
+        value *make(json::type type) noexcept;
+        char *copy_string(const char *str, std::size_t length) noexcept;
+        bool attachable(const value *container, const value *element) const noexcept;
+        bool reserve(const value *container) noexcept;
+        bool add(const value *object, const char *name, std::size_t length, const value *element) noexcept;
+        bool add_at(const char *path, std::size_t length, const value *element) noexcept;
+        const value *detach(const char *path, std::size_t length) noexcept;
+        void reattach(const value *container, unsigned int index, const object_entry &entry) noexcept;
+
+        static void *arena_alloc(std::size_t size, int zero, void *user_data) noexcept;
+        static void arena_free(void *, void *user_data) noexcept;
+
+        json::settings settings;
+        chunk *chunks;
+        const value *root_value;
+    };
+
+    // Immutable document whose ownership is shared by all copies of the handle, and freed
+    // with the last of them. Handles can be copied and destroyed by any number of threads.
+    class shared {
+    public:
+        struct control;
+
+        shared() noexcept : ctl(nullptr) {}
+        explicit shared(document &&doc) noexcept;  // empty if allocation failed
+        shared(const shared &other) noexcept;
+        shared(shared &&other) noexcept : ctl(other.ctl) { other.ctl = nullptr; }
+        shared &operator=(const shared &other) noexcept;
+        shared &operator=(shared &&other) noexcept;
+        ~shared();
+
+        // Parses input into a new document; with keep_input the document also owns a copy of
+        // the input, which was parsed instead of the original (e.g. for json::source)
+        static shared parse(const json::settings &settings, const char *json, std::size_t length,
+                            parse_error &error, bool keep_input = false) noexcept;
+        static shared parse(const json::settings &settings, const char *json, std::size_t length,
+                            char *error, bool keep_input = false) noexcept;
+
+        const value *root() const noexcept;
+        std::string_view input() const noexcept;
+        bool empty() const noexcept { return !ctl; }
+        void reset() noexcept;
+
+    private:
+        friend class shared_slot;
+        explicit shared(control *ctl) noexcept : ctl(ctl) {}
+
+        control *ctl;
+    };
+
+    // Publishes a shared document to many threads. load() never takes a lock nor waits for
+    // store(); store() waits only until readers which might have seen the previous document
+    // have taken their reference to it, and then releases its own.
+    class shared_slot {
+    public:
+        shared_slot() noexcept : current(nullptr), readers{}, epoch(0) {}
+        explicit shared_slot(shared document) noexcept;
+        ~shared_slot();
+
+        shared_slot(const shared_slot &) = delete;
+        shared_slot &operator=(const shared_slot &) = delete;
+
+        shared load() const noexcept;
+        void store(shared document) noexcept { exchange(std::move(document)); }
+        shared exchange(shared document) noexcept;
+
+    private:
+        std::atomic<shared::control *> current;
+        mutable std::atomic<std::size_t> readers[2];
+        std::atomic<std::size_t> epoch;
+        std::mutex writer;
+    };
+
+    // Value in compact layout, 16 bytes: numbers, booleans and strings of up to 14 bytes are held
+    // in place, within the table of elements of their array (or of members of their object)
+    struct cell {
+        union {
+            int64_t integer;  // also boolean
+            double dbl;
+            uint64_t offset;  // of long string, or of table of elements (name and value per member)
+        };
+        uint32_t length;
+        char padding[3];
+        uint8_t tag;  // json::type in lower 4 bits, length of short string (15 if long) in upper 4
+    };
+    static_assert(sizeof(cell) == 16);
+
+    // Read-only view of a value of json::compact, to be used like json::value
+    class node {
+    public:
+        node() noexcept : base(nullptr), cell(nullptr) {}
+        node(const char *base, const json::cell *cell) noexcept : base(base), cell(cell) {}
+
+        explicit operator bool() const noexcept { return cell; }
+        json::type type() const noexcept { return json::type(cell ? cell->tag & 0x0F : 0); }
+
+        bool boolean() const noexcept { return cell->integer; }
+        int64_t integer() const noexcept { return cell->integer; }
+        double dbl() const noexcept { return cell->dbl; }
+
+        // Null terminated
+        std::string_view string() const noexcept {
+            const unsigned int short_length = cell->tag >> 4;
+            return short_length != long_string ? std::string_view((const char *) cell, short_length)
+                                               : std::string_view(base + cell->offset, cell->length);
+        }
+
+        // Number of elements of array or members of object
+        unsigned int length() const noexcept { return cell->length; }
+
+        // Element of array, or value of object member
+        node operator[](unsigned int index) const noexcept {
+            const json::cell *table = (const json::cell *) (base + cell->offset);
+            return node(base, type() == json_object ? table + 2 * index + 1 : table + index);
+        }
+
+        std::string_view name(unsigned int index) const noexcept {
+            return node(base, (const json::cell *) (base + cell->offset) + 2 * index).string();
+        }
+
+        // Value of the first member with given name, empty node if there is none
+        node find(const char *name, std::size_t length) const noexcept;
+
+    private:
+        static constexpr unsigned int long_string = 15;
+
+        const char *base;
+        const json::cell *cell;
+    };
+
+    // Owns values parsed into compact layout: a single buffer of cells, with tables of each
+    // array and object contiguous, followed by strings longer than 14 bytes. Values cannot
+    // be modified; compared to json::parse, there are no nodes apart from table entries.
+    class compact {
+    public:
+        explicit compact(const json::settings &settings = json::settings()) noexcept;
+        compact(compact &&other) noexcept;
+        compact &operator=(compact &&other) noexcept;
+        ~compact();
+
+        compact(const compact &) = delete;
+        compact &operator=(const compact &) = delete;
+
+        // Parses input, replacing previous values
+        bool parse(const char *json, std::size_t length, parse_error &error) noexcept;
+        bool parse(const char *json, std::size_t length, char *error) noexcept;
+
+        node root() const noexcept { return buffer ? node(buffer, (const cell *) buffer) : node(); }
+        std::size_t size() const noexcept { return buffer_size; }  // in bytes
+        void clear() noexcept;
+
+    private:
+        json::settings settings;
+        char *buffer;
+        std::size_t buffer_size;
+    };
+
 } // namespace json
 
 #endif
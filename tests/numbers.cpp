@@ -0,0 +1,123 @@
+// Numbers parsed with and without settings.exact_numbers must compare and hash the same, and
+// json::compact must convert them to the same values
+
+#include <cstdio>
+#include <cstring>
+#include "json.hpp"
+
+namespace {
+
+    int failures = 0;
+
+    void fail(const char *test, const char *what) {
+        std::printf("%s: %s\n", test, what);
+        ++failures;
+    }
+
+    const json::value *parse(const char *text, bool exact, json::parse_error &error) {
+        json::settings settings = json::settings();
+        settings.exact_numbers = exact;
+        return json::parse(settings, text, std::strlen(text), error);
+    }
+
+    bool same_node(json::node node, const json::value *value) {
+        if (node.type() != value->type)
+            return false;
+
+        switch (value->type) {
+            case json::json_array:
+            case json::json_object:
+                if (node.length() != (value->type == json::json_array ? value->u.array.length
+                                                                      : value->u.object.length))
+                    return false;
+
+                for (unsigned int i = 0; i < node.length(); ++i) {
+                    const json::value *element = value->type == json::json_array
+                                                 ? value->u.array.values[i] : value->u.object.values[i].value;
+                    if (!same_node(node[i], element))
+                        return false;
+                }
+                return true;
+
+            case json::json_integer:
+                return node.integer() == value->u.integer;
+            case json::json_double: {
+                const double dbl = node.dbl();  // bitwise, so that -0.0 differs from 0.0
+                return std::memcmp(&dbl, &value->u.dbl, sizeof(dbl)) == 0;
+            }
+            default:
+                return true;
+        }
+    }
+
+    void same(const char *text) {
+        json::parse_error error;
+        const json::value *converted = parse(text, false, error);
+        const json::value *exact = parse(text, true, error);
+
+        if (!converted || !exact)
+            fail(text, "not parsed");
+        else if (!json::equal(converted, exact))
+            fail(text, "not equal");
+        else if (json::hash(converted) != json::hash(exact))
+            fail(text, "different hash");
+
+        json::compact compact(json::settings{});
+        if (!compact.parse(text, std::strlen(text), error))
+            fail(text, "not parsed into compact");
+        else if (converted && !same_node(compact.root(), converted))
+            fail(text, "different in compact");
+
+        json::value_free(converted);
+        json::value_free(exact);
+    }
+
+    void type(const char *text, json::type expected) {
+        json::parse_error error;
+        const json::value *root = parse(text, false, error);
+
+        if (!root || root->u.array.length != 1 || root->u.array.values[0]->type != expected)
+            fail(text, "wrong type");
+
+        json::value_free(root);
+    }
+
+    void rejected(const char *text) {
+        for (bool exact : {false, true}) {
+            json::parse_error error;
+            const json::value *root = parse(text, exact, error);
+
+            if (root)
+                fail(text, exact ? "accepted with exact_numbers" : "accepted");
+            else if (error.code != json::error_digit_after_minus)
+                fail(text, "wrong error");
+
+            json::value_free(root);
+        }
+
+        json::compact compact(json::settings{});
+        json::parse_error error;
+        if (compact.parse(text, std::strlen(text), error))
+            fail(text, "accepted into compact");
+    }
+
+} // namespace
+
+int main() {
+    same("[1.5e-1]");
+    same("[0.1, 0.2, 0.3, 1e23, 2.2250738585072014e-308, 4.9e-324]");
+    same("[12345678901234567890, -9223372036854775808, 9223372036854775807]");
+    same("[-0, 0, -0.0, 1e400, -1e400, 1e-400]");
+    same("{\"a\": [1, 2.5, -3e2], \"b\": 17976931348623157e292}");
+
+    type("[9223372036854775807]", json::json_integer);
+    type("[12345678901234567890]", json::json_double);
+    type("[1e2]", json::json_double);
+
+    rejected("[-]");
+    rejected("[-,1]");
+    rejected("-");
+    rejected("{\"a\": -}");
+
+    return failures != 0;
+}